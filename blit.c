@@ -21,57 +21,325 @@
  * IN THE SOFTWARE.
  *
  * Usage : blit-protected input.png output.png
+ *         blit-protected --watch input_dir --output-dir output_dir
+ *         blit-protected --manifest jobs.txt [--journal progress.log]
+ *         blit-protected --listen [address:]port
+ *         blit-protected --manifest jobs.txt --workers K
+ *         blit-protected --manifest jobs.txt --coordinate host:port,host:port,...
+ *         blit-protected --tune sample.png
+ *         blit-protected --verify --manifest jobs.txt
+ *         blit-protected --delta --watch input_dir --output-dir output_dir
+ *         blit-protected --sparse canvas.png output.png
  */
 
-#include <stdbool.h>
-#include <stdint.h>
+#include "blit.h"
 
-#include <gdk-pixbuf/gdk-pixbuf.h>
+G_DEFINE_QUARK(blit-error-quark, blit_error)
 
-#include <vulkan/vulkan.h>
+bool image_protected = true;
+bool gpu_verify = false;
+bool delta_uploads = false;
+bool sparse_images = false;
 
-struct data {
-   VkInstance instance;
-   VkPhysicalDevice physical_device;
-   VkPhysicalDeviceMemoryProperties memory_properties;
-   VkDevice device;
-   VkQueue queue;
+static char *watch_dir = NULL;
+static char *output_dir = NULL;
+static char *manifest_path = NULL;
+static char *journal_path = NULL;
+static char *listen_address = NULL;
+static char *coordinate = NULL;
+static int workers = 0;
+static char *tune_input = NULL;
+static gboolean verify = FALSE;
+static gboolean delta = FALSE;
+static gboolean sparse = FALSE;
+static char **crop_args = NULL;
+static char **scale_args = NULL;
+static gboolean timings = FALSE;
+static int depth = 0;
+static int staging_budget = 0;
 
-   VkCommandPool cmd_pool;
+/* Jobs in flight with --staging-budget, at most. */
+#define MAX_BUDGET_DEPTH 32
 
-   VkBuffer src_buffer;
-   VkDeviceMemory src_mem;
-
-   VkImage dst_image;
-   VkDeviceMemory dst_image_mem;
+static GOptionEntry entries[] = {
+   { "watch", 'w', 0, G_OPTION_ARG_FILENAME, &watch_dir,
+     "Process images written into DIR until interrupted", "DIR" },
+   { "output-dir", 'o', 0, G_OPTION_ARG_FILENAME, &output_dir,
+     "Directory receiving the outputs of --watch", "DIR" },
+   { "manifest", 'm', 0, G_OPTION_ARG_FILENAME, &manifest_path,
+     "Process the \"[id] input output\" lines of FILE", "FILE" },
+   { "journal", 'j', 0, G_OPTION_ARG_FILENAME, &journal_path,
+     "Record completed --manifest jobs in FILE and skip those already in it", "FILE" },
+   { "listen", 'l', 0, G_OPTION_ARG_STRING, &listen_address,
+     "Serve jobs to coordinators on [ADDRESS:]PORT", "ADDRESS" },
+   { "coordinate", 'c', 0, G_OPTION_ARG_STRING, &coordinate,
+     "Distribute --manifest over the comma-separated HOST:PORT daemons", "NODES" },
+   { "workers", 'k', 0, G_OPTION_ARG_INT, &workers,
+     "Run --manifest in K pre-forked worker processes", "K" },
+   { "depth", 'd', 0, G_OPTION_ARG_INT, &depth,
+     "Number of jobs in flight (default: as tuned, or 2)", "N" },
+   { "staging-budget", 0, 0, G_OPTION_ARG_INT, &staging_budget,
+     "Without --depth, put as many jobs in flight as their buffers fit in MIB (single file or --manifest)", "MIB" },
+   { "tune", 0, 0, G_OPTION_ARG_FILENAME, &tune_input,
+     "Find the fastest copy parameters for images the size of FILE", "FILE" },
+   { "crop", 0, 0, G_OPTION_ARG_STRING_ARRAY, &crop_args,
+     "Only read back and write WxH+X+Y, may be repeated (single file or --manifest)", "GEOMETRY" },
+   { "scale", 0, 0, G_OPTION_ARG_STRING_ARRAY, &scale_args,
+     "Also write a copy scaled to WxH, may be repeated (single file or --manifest)", "SIZE" },
+   { "sparse", 0, 0, G_OPTION_ARG_NONE, &sparse,
+     "Only bind memory to and copy the non-empty blocks of the images (unprotected)", NULL },
+   { "delta", 0, 0, G_OPTION_ARG_NONE, &delta,
+     "Only upload the tiles that changed since the previous frame of a slot", NULL },
+   { "verify", 0, 0, G_OPTION_ARG_NONE, &verify,
+     "Compare a GPU checksum of the copies with the inputs instead of writing outputs (unprotected)", NULL },
+   { "timings", 't', 0, G_OPTION_ARG_NONE, &timings,
+     "Print a breakdown of the startup time, and of the GPU time of unprotected jobs", NULL },
+   { NULL }
+};
 
-   VkBuffer dst_buffer;
-   VkDeviceMemory dst_mem;
+static VkDeviceSize
+lcm(VkDeviceSize a, VkDeviceSize b)
+{
+   VkDeviceSize x = a, y = b;
 
-   uint32_t width, height;
-   uint32_t row_stride, size;
-};
+   while (y) {
+      VkDeviceSize r = x % y;
+      x = y;
+      y = r;
+   }
 
-static bool image_protected = true;
+   return a / x * b;
+}
 
-static int find_image_memory(struct data *vc, unsigned allowed, bool host, bool protected)
+/* Memoized in the caps, the memory properties are only queried on a miss. */
+int find_image_memory(struct data *vc, unsigned allowed, bool host, bool protected)
 {
+   char *key = g_strdup_printf("%x-%d-%d", allowed, host, protected);
+   int index = -1;
+
+   if (caps_get(vc->caps, "memory", key, &index)) {
+      g_free(key);
+      return index;
+   }
+
+   if (!vc->have_memory_properties) {
+      vc->vk.GetPhysicalDeviceMemoryProperties(vc->physical_device, &vc->memory_properties);
+      vc->have_memory_properties = true;
+   }
+
    VkMemoryPropertyFlags flags =
       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
       (host ? VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT : 0) |
       (protected ? VK_MEMORY_PROPERTY_PROTECTED_BIT : 0);
 
     for (unsigned i = 0; (1u << i) <= allowed && i <= vc->memory_properties.memoryTypeCount; ++i) {
-        if ((allowed & (1u << i)) && (vc->memory_properties.memoryTypes[i].propertyFlags & flags))
-            return i;
+        if ((allowed & (1u << i)) && (vc->memory_properties.memoryTypes[i].propertyFlags & flags)) {
+            index = i;
+            break;
+        }
     }
-    return -1;
+
+   if (index >= 0) {
+      caps_set(vc->caps, "memory", key, index);
+      caps_save(vc->caps);
+   }
+   g_free(key);
+
+   return index;
+}
+
+/* What probe_device() finds out, and keeps in the caps. */
+struct device_choice {
+   int queue_family, compute_family, tiling, sync2;
+   int n_queues, n_compute_queues, timestamp_bits;
+};
+
+static bool
+has_extension(const VkExtensionProperties *extensions, uint32_t count, const char *name)
+{
+   for (uint32_t i = 0; i < count; i++) {
+      if (!strcmp(extensions[i].extensionName, name))
+         return true;
+   }
+
+   return false;
+}
+
+static void
+query_device(struct data *vc, VkQueueFlags required, struct device_choice *c)
+{
+   uint32_t n_extensions = 0;
+   vc->vk.EnumerateDeviceExtensionProperties(vc->physical_device, NULL, &n_extensions, NULL);
+   VkExtensionProperties extensions[MAX(n_extensions, 1)];
+   vc->vk.EnumerateDeviceExtensionProperties(vc->physical_device, NULL, &n_extensions, extensions);
+   bool sync2 = has_extension(extensions, n_extensions, VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME) &&
+                has_extension(extensions, n_extensions, VK_KHR_COPY_COMMANDS_2_EXTENSION_NAME);
+
+   VkPhysicalDeviceSynchronization2Features sync2_features = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES,
+   };
+   VkPhysicalDeviceProtectedMemoryFeatures protected_features = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROTECTED_MEMORY_FEATURES,
+      .pNext = sync2 ? &sync2_features : NULL,
+   };
+   VkPhysicalDeviceFeatures2 features = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+      .pNext = &protected_features,
+   };
+   vc->vk.GetPhysicalDeviceFeatures2(vc->physical_device, &features);
+
+   c->sync2 = sync2 && sync2_features.synchronization2;
+
+   g_assert(protected_features.protectedMemory);
+   if (sparse_images && !(features.features.sparseBinding && features.features.sparseResidencyImage2D))
+      g_error("--sparse requires sparse residency for 2D images");
+
+   uint32_t count = 0;
+   vc->vk.GetPhysicalDeviceQueueFamilyProperties(vc->physical_device, &count, NULL);
+   g_assert(count > 0);
+   VkQueueFamilyProperties props[count];
+   vc->vk.GetPhysicalDeviceQueueFamilyProperties(vc->physical_device, &count, props);
+
+   /* Any family with graphics supports transfers too. */
+   c->queue_family = -1;
+   for (uint32_t i = 0; i < count; i++) {
+      if ((props[i].queueFlags & required) == required) {
+         c->queue_family = i;
+         break;
+      }
+   }
+   g_assert(c->queue_family >= 0);
+
+   /* The checksums of --verify go to another family if one has compute,
+    * so that they run alongside the copies, see slot_submit().
+    */
+   VkQueueFlags compute = VK_QUEUE_COMPUTE_BIT | (required & VK_QUEUE_PROTECTED_BIT);
+   c->compute_family = -1;
+   for (uint32_t i = 0; i < count; i++) {
+      if ((int) i != c->queue_family && (props[i].queueFlags & compute) == compute) {
+         c->compute_family = i;
+         break;
+      }
+   }
+   if (c->compute_family < 0)
+      c->compute_family = c->queue_family;
+   if (gpu_verify && !(props[c->compute_family].queueFlags & VK_QUEUE_COMPUTE_BIT))
+      g_error("--verify requires a queue family with compute");
+
+   c->n_queues = props[c->queue_family].queueCount;
+   c->n_compute_queues = props[c->compute_family].queueCount;
+   c->timestamp_bits = props[c->queue_family].timestampValidBits;
+
+   VkFormatProperties format_properties;
+   VkFormatFeatureFlags transfer = VK_FORMAT_FEATURE_TRANSFER_SRC_BIT | VK_FORMAT_FEATURE_TRANSFER_DST_BIT;
+   vc->vk.GetPhysicalDeviceFormatProperties(vc->physical_device, VK_FORMAT_R8G8B8A8_UNORM, &format_properties);
+   c->tiling = (format_properties.optimalTilingFeatures & transfer) == transfer ?
+               VK_IMAGE_TILING_OPTIMAL : VK_IMAGE_TILING_LINEAR;
 }
 
+/* Picks the queue families and the image tiling, unless a previous run
+ * already did for this device and driver, along with the queue counts of
+ * the families, the timestamp bits of the copy family and whether there is
+ * synchronization2: init_vk() then makes no queries of its own.
+ */
 static void
+probe_device(struct data *vc, struct device_choice *c)
+{
+   /* The scaled copies and the chained jobs are blits, which need
+    * graphics, and any manifest line may ask for them.
+    */
+   VkQueueFlags required = VK_QUEUE_GRAPHICS_BIT |
+                           (image_protected ? VK_QUEUE_PROTECTED_BIT : 0) |
+                           (sparse_images ? VK_QUEUE_SPARSE_BINDING_BIT : 0);
+   const struct {
+      const char *name;
+      int *value;
+   } keys[] = {
+      { "queue-family", &c->queue_family },
+      { "compute-family", &c->compute_family },
+      { "queue-count", &c->n_queues },
+      { "compute-queue-count", &c->n_compute_queues },
+      { "timestamp-bits", &c->timestamp_bits },
+   };
+   char *names[G_N_ELEMENTS(keys)];
+   bool cached = caps_get(vc->caps, "device", "tiling", &c->tiling) &&
+                 caps_get(vc->caps, "device", "synchronization2", &c->sync2);
+
+   for (unsigned i = 0; i < G_N_ELEMENTS(keys); i++) {
+      names[i] = g_strdup_printf("%s-%x", keys[i].name, required);
+      cached = cached && caps_get(vc->caps, "device", names[i], keys[i].value);
+   }
+
+   if (!cached) {
+      query_device(vc, required, c);
+
+      caps_set(vc->caps, "device", "tiling", c->tiling);
+      caps_set(vc->caps, "device", "synchronization2", c->sync2);
+      for (unsigned i = 0; i < G_N_ELEMENTS(keys); i++)
+         caps_set(vc->caps, "device", names[i], *keys[i].value);
+   }
+
+   for (unsigned i = 0; i < G_N_ELEMENTS(keys); i++)
+      g_free(names[i]);
+
+   vc->queue_family = c->queue_family;
+   vc->compute_family = c->compute_family;
+   vc->tiling = c->tiling;
+   vc->sync2 = c->sync2;
+}
+
+/* Protected queues can only be retrieved with vkGetDeviceQueue2(). */
+static VkQueue *
+get_queues(struct data *vc, uint32_t family, uint32_t count)
+{
+   VkQueue *queues = g_new(VkQueue, count);
+
+   for (uint32_t i = 0; i < count; i++) {
+      vc->vk.GetDeviceQueue2(vc->device,
+                             &(VkDeviceQueueInfo2) {
+                                .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_INFO_2,
+                                .flags = image_protected ? VK_DEVICE_QUEUE_CREATE_PROTECTED_BIT : 0,
+                                .queueFamilyIndex = family,
+                                .queueIndex = i,
+                             },
+                             &queues[i]);
+   }
+
+   return queues;
+}
+
+static VkCommandPool
+create_cmd_pool(struct data *vc, uint32_t family)
+{
+   VkCommandPool pool;
+
+   vc->vk.CreateCommandPool(vc->device,
+                            &(const VkCommandPoolCreateInfo) {
+                               .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+                               .queueFamilyIndex = family,
+                               .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT |
+					(image_protected ? VK_COMMAND_POOL_CREATE_PROTECTED_BIT : 0),
+                            },
+                            NULL,
+                            &pool);
+
+   return pool;
+}
+
+void
 init_vk(struct data *vc)
 {
-   vkCreateInstance(&(VkInstanceCreateInfo) {
+   gint64 t0 = g_get_monotonic_time();
+
+   /* The loader scans for ICDs on its first entry point. */
+   vk_load_global(&vc->vk);
+
+   uint32_t api_version;
+   vc->vk.EnumerateInstanceVersion(&api_version);
+
+   gint64 t1 = g_get_monotonic_time();
+
+   vc->vk.CreateInstance(&(VkInstanceCreateInfo) {
          .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
          .pApplicationInfo = &(VkApplicationInfo) {
             .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
@@ -84,325 +352,1771 @@ init_vk(struct data *vc)
       NULL,
       &vc->instance);
 
+   vk_load_instance(&vc->vk, vc->instance);
+
+   gint64 t2 = g_get_monotonic_time();
+
    uint32_t count = 0;
-   VkResult res = vkEnumeratePhysicalDevices(vc->instance, &count, NULL);
+   VkResult res = vc->vk.EnumeratePhysicalDevices(vc->instance, &count, NULL);
    g_assert(res == VK_SUCCESS && count > 0);
    VkPhysicalDevice pd[count];
-   vkEnumeratePhysicalDevices(vc->instance, &count, pd);
+   vc->vk.EnumeratePhysicalDevices(vc->instance, &count, pd);
    vc->physical_device = pd[0];
    g_info("%d physical devices\n", count);
 
-   VkPhysicalDeviceProtectedMemoryFeatures protected_features = {
-      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROTECTED_MEMORY_FEATURES,
+   VkPhysicalDeviceIDProperties id_properties = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES,
    };
-   VkPhysicalDeviceFeatures2 features = {
-      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
-      .pNext = &protected_features,
+   VkPhysicalDeviceProperties2 properties = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+      .pNext = &id_properties,
    };
-   vkGetPhysicalDeviceFeatures2(vc->physical_device, &features);
+   vc->vk.GetPhysicalDeviceProperties2(vc->physical_device, &properties);
+   g_info("Vendor id %04x, device name %s\n",
+          properties.properties.vendorID, properties.properties.deviceName);
 
-   g_assert(protected_features.protectedMemory);
+   struct device_choice choice;
 
-   VkPhysicalDeviceProperties properties;
-   vkGetPhysicalDeviceProperties(vc->physical_device, &properties);
-   g_info("Vendor id %04x, device name %s\n", properties.vendorID, properties.deviceName);
+   vc->caps = caps_open(&id_properties, &properties.properties);
+   probe_device(vc, &choice);
 
-   vkGetPhysicalDeviceMemoryProperties(vc->physical_device, &vc->memory_properties);
+   /* Both alignments and whole texels, so that bands start aligned too. */
+   const VkPhysicalDeviceLimits *limits = &properties.properties.limits;
+   vc->copy_alignment = lcm(lcm(MAX(limits->optimalBufferCopyRowPitchAlignment, 1),
+                                MAX(limits->optimalBufferCopyOffsetAlignment, 1)), 4);
 
-   vkGetPhysicalDeviceQueueFamilyProperties(vc->physical_device, &count, NULL);
-   g_assert(count > 0);
-   VkQueueFamilyProperties props[count];
-   vkGetPhysicalDeviceQueueFamilyProperties(vc->physical_device, &count, props);
-   g_assert(props[0].queueFlags & VK_QUEUE_GRAPHICS_BIT);
-
-   vkCreateDevice(vc->physical_device,
-                  &(VkDeviceCreateInfo) {
-                     .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-                     .pNext = &protected_features,
-                     .queueCreateInfoCount = 1,
-                     .pQueueCreateInfos = &(VkDeviceQueueCreateInfo) {
-                        .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-                        .queueFamilyIndex = 0,
-                        .queueCount = 1,
-                        .flags = image_protected ? VK_DEVICE_QUEUE_CREATE_PROTECTED_BIT : 0,
-                        .pQueuePriorities = (float []) { 1.0f },
-                     },
-                     .enabledExtensionCount = 0,
-                     .ppEnabledExtensionNames = NULL,
-                  },
-                  NULL,
-                  &vc->device);
-
-   vkGetDeviceQueue(vc->device, 0, 0, &vc->queue);
+   vc->n_queues = choice.n_queues;
+   vc->n_compute_queues = gpu_verify && vc->compute_family != vc->queue_family ?
+                          choice.n_compute_queues : 0;
+   float priorities[MAX(vc->n_queues, vc->n_compute_queues)];
+   for (uint32_t i = 0; i < G_N_ELEMENTS(priorities); i++)
+      priorities[i] = 1.0f;
+
+   /* Queries aren't allowed in protected command buffers. */
+   if (timings && !image_protected && choice.timestamp_bits > 0)
+      vc->timestamp_period = limits->timestampPeriod;
+
+   gint64 t3 = g_get_monotonic_time();
+
+   /* Barriers and copies are recorded with the synchronization2 and
+    * copy_commands2 versions when the device has them, see dispatch.c.
+    */
+   const char *extensions[] = {
+      VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME,
+      VK_KHR_COPY_COMMANDS_2_EXTENSION_NAME,
+   };
+
+   res = vc->vk.CreateDevice(vc->physical_device,
+                             &(VkDeviceCreateInfo) {
+                                .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+                                .pNext = &(VkPhysicalDeviceProtectedMemoryFeatures) {
+                                   .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROTECTED_MEMORY_FEATURES,
+                                   .pNext = vc->sync2 ? &(VkPhysicalDeviceSynchronization2Features) {
+                                      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES,
+                                      .synchronization2 = VK_TRUE,
+                                   } : NULL,
+                                   .protectedMemory = image_protected,
+                                },
+                                .queueCreateInfoCount = vc->n_compute_queues > 0 ? 2 : 1,
+                                .pQueueCreateInfos = (VkDeviceQueueCreateInfo[]) {
+                                   {
+                                      .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+                                      .queueFamilyIndex = vc->queue_family,
+                                      .queueCount = vc->n_queues,
+                                      .flags = image_protected ? VK_DEVICE_QUEUE_CREATE_PROTECTED_BIT : 0,
+                                      .pQueuePriorities = priorities,
+                                   },
+                                   {
+                                      .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+                                      .queueFamilyIndex = vc->compute_family,
+                                      .queueCount = vc->n_compute_queues,
+                                      .flags = image_protected ? VK_DEVICE_QUEUE_CREATE_PROTECTED_BIT : 0,
+                                      .pQueuePriorities = priorities,
+                                   },
+                                },
+                                .enabledExtensionCount = vc->sync2 ? G_N_ELEMENTS(extensions) : 0,
+                                .ppEnabledExtensionNames = extensions,
+                                .pEnabledFeatures = &(VkPhysicalDeviceFeatures) {
+                                   .sparseBinding = sparse_images,
+                                   .sparseResidencyImage2D = sparse_images,
+                                },
+                             },
+                             NULL,
+                             &vc->device);
+   if (res != VK_SUCCESS)
+      g_error("Unable to create the device (%d)", res);
+
+   vk_load_device(&vc->vk, vc->device, vc->sync2);
+
+   vc->queues = get_queues(vc, vc->queue_family, vc->n_queues);
+   vc->next_queue = 0;
+   vc->cmd_pool = create_cmd_pool(vc, vc->queue_family);
+
+   if (vc->n_compute_queues > 0) {
+      vc->compute_queues = get_queues(vc, vc->compute_family, vc->n_compute_queues);
+      vc->compute_pool = create_cmd_pool(vc, vc->compute_family);
+   } else {
+      vc->compute_pool = vc->cmd_pool;
+   }
+   vc->next_compute_queue = 0;
+
+   vc->compiler = compiler_create(vc, &properties.properties);
+   if (gpu_verify)
+      vc->checksum = checksum_create(vc);
+
+   caps_save(vc->caps);
+
+   gint64 t4 = g_get_monotonic_time();
+
+   vc->init_time.loader = t1 - t0;
+   vc->init_time.instance = t2 - t1;
+   vc->init_time.enumeration = t3 - t2;
+   vc->init_time.device = t4 - t3;
 }
 
-static void
-init_image(struct data *vc, const char *filename)
+/* Also valid on a lost device, ahead of init_vk() bringing up a new one. */
+void
+fini_vk(struct data *vc)
 {
-   GError *error = NULL;
-   GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(filename, &error);
+   if (vc->checksum)
+      checksum_destroy(vc, vc->checksum);
+   registry_clear(vc);
+   compiler_destroy(vc->compiler);
+   if (vc->compute_pool != vc->cmd_pool)
+      vc->vk.DestroyCommandPool(vc->device, vc->compute_pool, NULL);
+   vc->vk.DestroyCommandPool(vc->device, vc->cmd_pool, NULL);
+   vc->vk.DestroyDevice(vc->device, NULL);
+   vc->vk.DestroyInstance(vc->instance, NULL);
+   caps_close(vc->caps);
+   g_clear_pointer(&vc->queues, g_free);
+   g_clear_pointer(&vc->compute_queues, g_free);
+
+   vc->caps = NULL;
+   vc->compiler = NULL;
+   vc->checksum = NULL;
+   vc->have_memory_properties = false;
+   vc->cmd_pool = VK_NULL_HANDLE;
+   vc->compute_pool = VK_NULL_HANDLE;
+   vc->device = VK_NULL_HANDLE;
+   vc->instance = VK_NULL_HANDLE;
+}
+
+void
+slot_init(struct data *vc, struct slot *slot)
+{
+   *slot = (struct slot) { 0, };
+
+   /* Independent jobs don't wait for each other on separate queues. */
+   slot->queue = vc->queues[vc->next_queue++ % vc->n_queues];
+
+   vc->vk.AllocateCommandBuffers(vc->device,
+      &(VkCommandBufferAllocateInfo) {
+         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+         .commandPool = vc->cmd_pool,
+         .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+         .commandBufferCount = 1,
+      },
+      &slot->cmd_buffer);
+
+   /* Without a compute family of its own, the checksum follows the upload
+    * on the slot's queue, which other slots' copies don't wait behind.
+    */
+   if (gpu_verify) {
+      if (vc->n_compute_queues > 0)
+         slot->compute_queue = vc->compute_queues[vc->next_compute_queue++ % vc->n_compute_queues];
+      else
+         slot->compute_queue = slot->queue;
+
+      vc->vk.AllocateCommandBuffers(vc->device,
+         &(VkCommandBufferAllocateInfo) {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = vc->compute_pool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1,
+         },
+         &slot->compute_cmd_buffer);
 
-   if (!pixbuf) {
-      g_error("Unable to load image: %s", error->message);
-      exit(-1);
+      vc->vk.CreateSemaphore(vc->device,
+                             &(VkSemaphoreCreateInfo) {
+                                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+                             },
+                             NULL,
+                             &slot->uploaded);
    }
 
-   vc->width = gdk_pixbuf_get_width(pixbuf);
-   vc->height = gdk_pixbuf_get_height(pixbuf);
-   vc->row_stride = gdk_pixbuf_get_rowstride(pixbuf);
-   vc->size = gdk_pixbuf_get_byte_length(pixbuf);
+   vc->vk.CreateFence(vc->device,
+                      &(VkFenceCreateInfo) {
+                         .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+                      },
+                      NULL,
+                      &slot->fence);
 
-   VkMemoryRequirements requirements;
+   if (vc->timestamp_period > 0) {
+      vc->vk.CreateQueryPool(vc->device,
+                             &(VkQueryPoolCreateInfo) {
+                                .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+                                .queryType = VK_QUERY_TYPE_TIMESTAMP,
+                                .queryCount = 2,
+                             },
+                             NULL,
+                             &slot->timestamps);
+   }
+}
+
+static void
+release_dst_buffer(struct data *vc, struct slot *slot)
+{
+   if (slot->dst_map)
+      vc->vk.UnmapMemory(vc->device, slot->dst_mem);
+   vc->vk.DestroyBuffer(vc->device, slot->dst_buffer, NULL);
+   vc->vk.FreeMemory(vc->device, slot->dst_mem, NULL);
 
-   /* SRC */
-   vkCreateBuffer(vc->device,
-                  &(VkBufferCreateInfo) {
-                     .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-                     .flags = 0,
-                     .size = vc->size,
-                     .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                     .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-                  },
-                  NULL,
-                  &vc->src_buffer);
-
-   vkGetBufferMemoryRequirements(vc->device, vc->src_buffer, &requirements);
-
-   vkAllocateMemory(vc->device,
-                    &(VkMemoryAllocateInfo) {
-                       .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-                       .allocationSize = requirements.size,
-                       .memoryTypeIndex = find_image_memory(vc, requirements.memoryTypeBits, true /* host */, false /* protected */),
-                    },
-                    NULL,
-                    &vc->src_mem);
-
-   vkBindBufferMemory(vc->device, vc->src_buffer, vc->src_mem, 0);
-
-   void *map;
-   vkMapMemory(vc->device, vc->src_mem, 0, vc->size, 0, &map);
-   memcpy(map, gdk_pixbuf_read_pixels(pixbuf), vc->size);
-   vkUnmapMemory(vc->device, vc->src_mem);
-
-   g_object_unref(G_OBJECT(pixbuf));
-
-   /* DST */
-   vkCreateImage(vc->device,
-                 &(VkImageCreateInfo) {
-                    .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
-                    .imageType = VK_IMAGE_TYPE_2D,
-                    .format = VK_FORMAT_R8G8B8A8_UNORM,
-                    .extent = { .width = vc->width, .height = vc->height, .depth = 1 },
-                    .mipLevels = 1,
-                    .arrayLayers = 1,
-                    .samples = 1,
-                    .tiling = VK_IMAGE_TILING_OPTIMAL,
-                    .usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
-  		    .flags = image_protected ? VK_IMAGE_CREATE_PROTECTED_BIT : 0,
-                 },
-                 NULL,
-                 &vc->dst_image);
-
-   vkGetImageMemoryRequirements(vc->device, vc->dst_image, &requirements);
-
-   vkAllocateMemory(vc->device,
-                    &(VkMemoryAllocateInfo) {
-                       .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-                       .allocationSize = requirements.size,
-                       .memoryTypeIndex = find_image_memory(vc, requirements.memoryTypeBits, false /* host */, image_protected /* protected */),
-                    },
-                    NULL,
-                    &vc->dst_image_mem);
-
-   vkBindImageMemory(vc->device, vc->dst_image, vc->dst_image_mem, 0);
-
-   /* OUTPUT MEMORY */
-   vkCreateBuffer(vc->device,
-                  &(VkBufferCreateInfo) {
-                     .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-                     .flags = 0,
-                     .size = vc->size,
-                     .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                     .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-                  },
-                  NULL,
-                  &vc->dst_buffer);
-
-   vkGetBufferMemoryRequirements(vc->device, vc->dst_buffer, &requirements);
-
-   vkAllocateMemory(vc->device,
-                    &(VkMemoryAllocateInfo) {
-                       .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-                       .allocationSize = requirements.size,
-                       .memoryTypeIndex = find_image_memory(vc, requirements.memoryTypeBits, true /* host */, false /* protected */),
-                    },
-                    NULL,
-                    &vc->dst_mem);
-
-   vkBindBufferMemory(vc->device, vc->dst_buffer, vc->dst_mem, 0);
+   slot->dst_map = NULL;
+   slot->dst_buffer = VK_NULL_HANDLE;
+   slot->dst_mem = VK_NULL_HANDLE;
+   slot->dst_size = 0;
 }
 
 static void
-write_image_output(struct data *vc, const char *filename)
+slot_release_images(struct data *vc, struct slot *slot)
 {
-   void *map;
-   vkMapMemory(vc->device, vc->dst_mem, 0, vc->size, 0, &map);
+   if (slot->src_map)
+      vc->vk.UnmapMemory(vc->device, slot->src_mem);
 
-   GdkPixbuf *pixbuf = gdk_pixbuf_new_from_data(map,
-                                                GDK_COLORSPACE_RGB,
-                                                true,
-                                                8,
-                                                vc->width,
-                                                vc->height,
-                                                vc->row_stride,
-                                                NULL,
-                                                NULL);
+   vc->vk.DestroyBuffer(vc->device, slot->src_buffer, NULL);
+   vc->vk.FreeMemory(vc->device, slot->src_mem, NULL);
+   vc->vk.DestroyImage(vc->device, slot->dst_image, NULL);
+   vc->vk.FreeMemory(vc->device, slot->dst_image_mem, NULL);
+   release_dst_buffer(vc, slot);
+   vc->vk.DestroyImage(vc->device, slot->scale_image, NULL);
+   vc->vk.FreeMemory(vc->device, slot->scale_mem, NULL);
+   if (gpu_verify)
+      checksum_slot_release(vc, slot);
+   if (sparse_images)
+      sparse_release(vc, slot);
+   delta_release(slot);
 
-   GError *error = NULL;
-   if (!gdk_pixbuf_save(pixbuf, filename, "png", &error, NULL))
-      g_error("Could not write output file: %s", error->message);
+   slot->src_map = slot->readback_map = NULL;
+   slot->src_buffer = slot->readback_buffer = VK_NULL_HANDLE;
+   slot->src_mem = slot->dst_image_mem = VK_NULL_HANDLE;
+   slot->dst_image = slot->scale_image = VK_NULL_HANDLE;
+   slot->scale_mem = VK_NULL_HANDLE;
+   slot->scale_width = slot->scale_height = 0;
+   slot->layout = VK_IMAGE_LAYOUT_UNDEFINED;
+   slot->recorded = false;
+}
+
+static bool
+init_dst_image(struct data *vc, struct slot *slot)
+{
+   VkMemoryRequirements requirements;
+   VkResult res;
+
+   vc->vk.CreateImage(vc->device,
+                      &(VkImageCreateInfo) {
+                         .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+                         .imageType = VK_IMAGE_TYPE_2D,
+                         .format = VK_FORMAT_R8G8B8A8_UNORM,
+                         .extent = { .width = slot->width, .height = slot->height, .depth = 1 },
+                         .mipLevels = 1,
+                         .arrayLayers = 1,
+                         .samples = 1,
+                         .tiling = slot->tiling,
+                         .usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                                  (gpu_verify ? VK_IMAGE_USAGE_STORAGE_BIT : 0),
+                         .flags = image_protected ? VK_IMAGE_CREATE_PROTECTED_BIT : 0,
+                      },
+                      NULL,
+                      &slot->dst_image);
+
+   vc->vk.GetImageMemoryRequirements(vc->device, slot->dst_image, &requirements);
+
+   res = vc->vk.AllocateMemory(vc->device,
+                               &(VkMemoryAllocateInfo) {
+                                  .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                                  .allocationSize = requirements.size,
+                                  .memoryTypeIndex = find_image_memory(vc, requirements.memoryTypeBits, false /* host */, image_protected /* protected */),
+                               },
+                               NULL,
+                               &slot->dst_image_mem);
+   if (res != VK_SUCCESS)
+      return false;
 
-   vkUnmapMemory(vc->device, vc->dst_mem);
+   vc->vk.BindImageMemory(vc->device, slot->dst_image, slot->dst_image_mem, 0);
+
+   return true;
 }
 
-int
-main(int argc, char *argv[])
+/* Only for the jobs uploading pixels or reading back, a chained job whose
+ * output is "-" needs neither.
+ */
+static bool
+init_src_buffer(struct data *vc, struct slot *slot)
 {
-   struct data data = {}, *vc = &data;
-   VkCommandBuffer cmd_buffer;
+   VkMemoryRequirements requirements;
+   VkResult res;
 
-   if (argc < 3)
-      g_error("Require 2 arguments : input_file output_file");
+   vc->vk.CreateBuffer(vc->device,
+                       &(VkBufferCreateInfo) {
+                          .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+                          .flags = 0,
+                          .size = slot->size,
+                          /* Also where the readback goes when it fits. */
+                          .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                          .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+                       },
+                       NULL,
+                       &slot->src_buffer);
+
+   vc->vk.GetBufferMemoryRequirements(vc->device, slot->src_buffer, &requirements);
+
+   res = vc->vk.AllocateMemory(vc->device,
+                               &(VkMemoryAllocateInfo) {
+                                  .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                                  .allocationSize = requirements.size,
+                                  .memoryTypeIndex = find_image_memory(vc, requirements.memoryTypeBits, true /* host */, false /* protected */),
+                               },
+                               NULL,
+                               &slot->src_mem);
+   if (res != VK_SUCCESS)
+      return false;
+
+   vc->vk.BindBufferMemory(vc->device, slot->src_buffer, slot->src_mem, 0);
+   vc->vk.MapMemory(vc->device, slot->src_mem, 0, slot->size, 0, &slot->src_map);
 
-   init_vk(&data);
+   return true;
+}
+
+static bool
+init_image(struct data *vc, struct slot *slot)
+{
+   if (!(sparse_images ? sparse_image_init(vc, slot) : init_dst_image(vc, slot)))
+      return false;
+
+   /* Nothing is read back when verifying. */
+   if (gpu_verify)
+      return checksum_slot_init(vc, slot);
+
+   return true;
+}
+
+static bool
+init_dst_buffer(struct data *vc, struct slot *slot, uint32_t size)
+{
+   VkMemoryRequirements requirements;
+   VkResult res;
 
-   init_image(&data, argv[1]);
+   release_dst_buffer(vc, slot);
+   slot->dst_size = size;
+   slot->recorded = false;
 
-   vkCreateCommandPool(vc->device,
-                       &(const VkCommandPoolCreateInfo) {
-                          .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-                          .queueFamilyIndex = 0,
-                          .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT |
-				   (image_protected ? VK_COMMAND_POOL_CREATE_PROTECTED_BIT : 0),
+   vc->vk.CreateBuffer(vc->device,
+                       &(VkBufferCreateInfo) {
+                          .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+                          .flags = 0,
+                          .size = size,
+                          .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                          .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
                        },
                        NULL,
-                       &vc->cmd_pool);
+                       &slot->dst_buffer);
 
-   vkAllocateCommandBuffers(vc->device,
-      &(VkCommandBufferAllocateInfo) {
-         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-         .commandPool = vc->cmd_pool,
-         .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-         .commandBufferCount = 1,
-      },
-      &cmd_buffer);
+   vc->vk.GetBufferMemoryRequirements(vc->device, slot->dst_buffer, &requirements);
 
-   vkBeginCommandBuffer(cmd_buffer,
-                        &(VkCommandBufferBeginInfo) {
-                           .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-                           .flags = 0
-                        });
+   res = vc->vk.AllocateMemory(vc->device,
+                               &(VkMemoryAllocateInfo) {
+                                  .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                                  .allocationSize = requirements.size,
+                                  .memoryTypeIndex = find_image_memory(vc, requirements.memoryTypeBits, true /* host */, false /* protected */),
+                               },
+                               NULL,
+                               &slot->dst_mem);
+   if (res != VK_SUCCESS)
+      return false;
 
-   vkCmdPipelineBarrier(cmd_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
-                        0, 0, NULL,
-                        1, &(const VkBufferMemoryBarrier) {
-                           .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
-                           .srcAccessMask = 0,
-                           .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
-                           .buffer = vc->src_buffer,
-                           .offset = 0,
-                           .size = VK_WHOLE_SIZE,
-                        },
-                        1, &(const VkImageMemoryBarrier) {
-                           .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-                           .srcAccessMask = 0,
-                           .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-                           .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-                           .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                           .image = vc->dst_image,
-                           .subresourceRange = {
-                              .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                              .baseMipLevel = 0,
-                              .levelCount = 1,
-                              .baseArrayLayer = 0,
-                              .layerCount = 1,
-                           },
-                        });
+   vc->vk.BindBufferMemory(vc->device, slot->dst_buffer, slot->dst_mem, 0);
+   vc->vk.MapMemory(vc->device, slot->dst_mem, 0, size, 0, &slot->dst_map);
 
-   vkCmdCopyBufferToImage(cmd_buffer, vc->src_buffer, vc->dst_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
-                          &(const VkBufferImageCopy) {
-                             .bufferOffset = 0,
-                             .bufferRowLength = vc->width,
-                             .bufferImageHeight = vc->height,
-                             .imageSubresource = {
-                                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                                .mipLevel = 0,
-                                .baseArrayLayer = 0,
-                                .layerCount = 1,
-                             },
-                             .imageOffset = { 0, 0, 0, },
-                             .imageExtent = { vc->width, vc->height, 1 },
-                          });
-
-   vkCmdPipelineBarrier(cmd_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
-                        0, 0, NULL,
-                        1, &(const VkBufferMemoryBarrier) {
-                           .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
-                           .srcAccessMask = 0,
-                           .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-                           .buffer = vc->dst_buffer,
-                           .offset = 0,
-                           .size = VK_WHOLE_SIZE,
-                        },
-                        1, &(const VkImageMemoryBarrier) {
-                           .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-                           .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-                           .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
-                           .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                           .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                           .image = vc->dst_image,
-                           .subresourceRange = {
-                              .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                              .baseMipLevel = 0,
-                              .levelCount = 1,
-                              .baseArrayLayer = 0,
-                              .layerCount = 1,
-                           },
-                        });
+   return true;
+}
 
-   vkCmdCopyImageToBuffer(cmd_buffer, vc->dst_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, vc->dst_buffer, 1,
-                          &(const VkBufferImageCopy) {
-                             .bufferOffset = 0,
-                             .bufferRowLength = vc->width,
-                             .bufferImageHeight = vc->height,
-                             .imageSubresource = {
-                                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                                .mipLevel = 0,
-                                .baseArrayLayer = 0,
-                                .layerCount = 1,
-                             },
-                             .imageOffset = { 0, 0, 0, },
-                             .imageExtent = { vc->width, vc->height, 1 },
-                          });
+/* Host memory for the readback is only needed by the jobs writing outputs,
+ * and when the readback fits, it goes to the staging buffer the upload
+ * came from, which the copies are done with by then. A sparse image's
+ * readback goes to a cleared buffer of its own.
+ */
+static bool
+prepare_readback(struct data *vc, struct slot *slot, uint32_t size)
+{
+   VkBuffer buffer = slot->src_buffer;
+   void *map = slot->src_map;
 
-   vkEndCommandBuffer(cmd_buffer);
+   if (!slot->readback || gpu_verify)
+      return true;
 
-   VkProtectedSubmitInfo prot_submit = {
-      .sType = VK_STRUCTURE_TYPE_PROTECTED_SUBMIT_INFO,
-      .protectedSubmit = image_protected,
-   };
-   vkQueueSubmit(vc->queue, 1,
-                 &(const VkSubmitInfo) {
-                    .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-		    .pNext = &prot_submit,
-                    .commandBufferCount = 1,
-                    .pCommandBuffers = &cmd_buffer,
-                 },
-                 VK_NULL_HANDLE);
+   if (size > slot->size || sparse_images) {
+      if (slot->dst_size < size && !init_dst_buffer(vc, slot, size))
+         return false;
+      buffer = slot->dst_buffer;
+      map = slot->dst_map;
+   }
+
+   if (slot->readback_buffer != buffer) {
+      slot->readback_buffer = buffer;
+      slot->readback_map = map;
+      slot->recorded = false;
+   }
+
+   return true;
+}
+
+static bool
+init_scale_image(struct data *vc, struct slot *slot, uint32_t width, uint32_t height)
+{
+   VkMemoryRequirements requirements;
+   VkResult res;
+
+   vc->vk.DestroyImage(vc->device, slot->scale_image, NULL);
+   vc->vk.FreeMemory(vc->device, slot->scale_mem, NULL);
+   slot->scale_image = VK_NULL_HANDLE;
+   slot->scale_mem = VK_NULL_HANDLE;
+   slot->scale_width = slot->scale_height = 0;
+
+   vc->vk.CreateImage(vc->device,
+                      &(VkImageCreateInfo) {
+                         .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+                         .imageType = VK_IMAGE_TYPE_2D,
+                         .format = VK_FORMAT_R8G8B8A8_UNORM,
+                         .extent = { .width = width, .height = height, .depth = 1 },
+                         .mipLevels = 1,
+                         .arrayLayers = 1,
+                         .samples = 1,
+                         .tiling = VK_IMAGE_TILING_OPTIMAL,
+                         .usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+                         .flags = image_protected ? VK_IMAGE_CREATE_PROTECTED_BIT : 0,
+                      },
+                      NULL,
+                      &slot->scale_image);
+
+   vc->vk.GetImageMemoryRequirements(vc->device, slot->scale_image, &requirements);
+
+   res = vc->vk.AllocateMemory(vc->device,
+                               &(VkMemoryAllocateInfo) {
+                                  .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                                  .allocationSize = requirements.size,
+                                  .memoryTypeIndex = find_image_memory(vc, requirements.memoryTypeBits, false /* host */, image_protected /* protected */),
+                               },
+                               NULL,
+                               &slot->scale_mem);
+   if (res != VK_SUCCESS)
+      return false;
+
+   vc->vk.BindImageMemory(vc->device, slot->scale_image, slot->scale_mem, 0);
+   slot->scale_width = width;
+   slot->scale_height = height;
+
+   return true;
+}
+
+/* Bytes per row of a width wide image in the staging buffer, tightly
+ * packed or padded to the optimal copy alignments.
+ */
+uint32_t
+staging_pitch(struct data *vc, uint32_t width, bool padded)
+{
+   VkDeviceSize pitch = (VkDeviceSize) width * 4;
+
+   if (padded)
+      pitch = (pitch + vc->copy_alignment - 1) / vc->copy_alignment * vc->copy_alignment;
+
+   return pitch;
+}
+
+/* Copies pixbuf to the staging buffer, row by row when the pitches differ. */
+static void
+upload_pixels(struct slot *slot, GdkPixbuf *pixbuf)
+{
+   const guint8 *pixels = gdk_pixbuf_read_pixels(pixbuf);
+
+   if (slot->pitch == slot->row_stride) {
+      memcpy(slot->src_map, pixels, gdk_pixbuf_get_byte_length(pixbuf));
+      return;
+   }
+
+   for (uint32_t y = 0; y < slot->height; y++)
+      memcpy((guint8 *) slot->src_map + (gsize) y * slot->pitch,
+             pixels + (gsize) y * slot->row_stride, slot->width * 4);
+}
+
+bool
+slot_prepare(struct data *vc, struct slot *slot, struct job *job)
+{
+   GdkPixbuf *pixbuf = job->pixbuf;
+   uint32_t width, height, row_stride;
+
+   if (job->source) {
+      width = job->scale_width ? job->scale_width : job->source->width;
+      height = job->scale_height ? job->scale_height : job->source->height;
+      row_stride = width * 4;
+   } else {
+      width = gdk_pixbuf_get_width(pixbuf);
+      height = gdk_pixbuf_get_height(pixbuf);
+      row_stride = gdk_pixbuf_get_rowstride(pixbuf);
+   }
+
+   uint32_t dst_size = 0;
+
+   slot->job = job;
+
+   /* Non-resident blocks read back undefined, only whole images work. */
+   if (sparse_images && (job->n_crops > 0 || job->n_scales > 0 || job->source || job->keep > 0)) {
+      g_warning("%s: --sparse only writes whole images", job->input);
+      return false;
+   }
+
+   for (unsigned i = 0; i < job->n_crops; i++) {
+      const struct rect *r = &job->crops[i];
+
+      if (r->x >= width || r->width > width - r->x ||
+          r->y >= height || r->height > height - r->y) {
+         g_warning("%s: crop %ux%u+%u+%u is outside of the %ux%u image",
+                   job->input, r->width, r->height, r->x, r->y, width, height);
+         return false;
+      }
+      dst_size += r->width * r->height * 4;
+   }
+
+   /* Read back after the crops, or the whole image. */
+   uint32_t scale_width = 0, scale_height = 0;
+   for (unsigned i = 0; i < job->n_scales; i++) {
+      const struct rect *r = &job->scales[i];
+
+      scale_width = MAX(scale_width, r->width);
+      scale_height += r->height;
+      dst_size += r->width * r->height * 4;
+   }
+
+   /* Storage images and blits are only guaranteed with optimal tiling. */
+   bool optimal = gpu_verify || job->source || job->keep > 0 || job->n_scales > 0;
+
+   /* Keep the warm resources (and recorded commands) if the image fits. */
+   if (slot->dst_image == VK_NULL_HANDLE ||
+       (optimal && slot->tiling != VK_IMAGE_TILING_OPTIMAL) ||
+       slot->width != width || slot->height != height || slot->row_stride != row_stride) {
+      slot_release_images(vc, slot);
+
+      struct tuning t;
+      tuning_lookup(vc, width, height, &t);
+
+      slot->width = width;
+      slot->height = height;
+      slot->row_stride = row_stride;
+      slot->pitch = staging_pitch(vc, width, t.padded);
+      slot->size = slot->pitch * height;
+      slot->tiling = optimal ? VK_IMAGE_TILING_OPTIMAL : t.tiling;
+      slot->tuned_general = t.general;
+      slot->tile_width = t.tile_width ? MIN(t.tile_width, width) : width;
+      slot->tile_height = t.tile_height ? MIN(t.tile_height, height) : height;
+
+      if (!init_image(vc, slot)) {
+         g_warning("Unable to allocate memory for %s (%ux%u)", job->input, width, height);
+         slot_release_images(vc, slot);
+         return false;
+      }
+   }
+
+   bool readback = !job->output || strcmp(job->output, "-") != 0;
+
+   if ((!job->source || readback) && slot->src_buffer == VK_NULL_HANDLE &&
+       !init_src_buffer(vc, slot)) {
+      g_warning("Unable to allocate memory for %s (%ux%u)", job->input, width, height);
+      slot_release_images(vc, slot);
+      return false;
+   }
+
+   if (job->n_crops == 0)
+      dst_size += slot->size;
+
+   if (slot->n_crops != job->n_crops ||
+       memcmp(slot->crops, job->crops, job->n_crops * sizeof(struct rect))) {
+      g_free(slot->crops);
+      slot->crops = g_memdup2(job->crops, job->n_crops * sizeof(struct rect));
+      slot->n_crops = job->n_crops;
+      slot->recorded = false;
+   }
+
+   if (slot->n_scales != job->n_scales ||
+       memcmp(slot->scales, job->scales, job->n_scales * sizeof(struct rect))) {
+      g_free(slot->scales);
+      slot->scales = g_memdup2(job->scales, job->n_scales * sizeof(struct rect));
+      slot->n_scales = job->n_scales;
+      slot->recorded = false;
+   }
+
+   /* Nothing is read back when verifying. */
+   if (!gpu_verify && (slot->scale_width < scale_width || slot->scale_height < scale_height)) {
+      if (!init_scale_image(vc, slot, MAX(slot->scale_width, scale_width),
+                            MAX(slot->scale_height, scale_height))) {
+         g_warning("Unable to allocate memory for the scaled copies of %s", job->input);
+         return false;
+      }
+      slot->recorded = false;
+   }
+
+   /* Nothing changes layout if the image stays in GENERAL, except for
+    * the jobs blitting from it and the checksum, which reads in GENERAL
+    * already.
+    */
+   bool general = slot->tuned_general && job->keep == 0 && !gpu_verify;
+   if (slot->general != general) {
+      slot->general = general;
+      slot->recorded = false;
+   }
+
+   /* Commands blitting from a source have to go along with it. */
+   VkImage source = job->source ? job->source->image : VK_NULL_HANDLE;
+
+   if (source || slot->source || slot->readback != readback) {
+      slot->source = source;
+      slot->readback = readback;
+      slot->recorded = false;
+   }
+
+   if (!prepare_readback(vc, slot, dst_size)) {
+      g_warning("Unable to allocate memory for the output of %s", job->input);
+      return false;
+   }
+
+   if (source) {
+      /* The blit replaces the whole image, there's nothing to diff with. */
+      delta_release(slot);
+   } else if (delta_uploads) {
+      float changed = delta_upload(slot, pixbuf);
+
+      g_info("%s: %.1f%% of the tiles changed\n", job->input, changed * 100.0f);
+      slot->recorded = false;
+   } else {
+      upload_pixels(slot, pixbuf);
+   }
+
+   if (sparse_images) {
+      float resident = sparse_bind(vc, slot, pixbuf);
+
+      if (resident < 0.0f) {
+         g_warning("Unable to allocate memory for %s", job->input);
+         return false;
+      }
+      g_info("%s: %.1f%% of the blocks are resident\n", job->input, resident * 100.0f);
+      slot->recorded = false;
+   }
+
+   /* Checked last, the checksum compiles in the background meanwhile. */
+   if (gpu_verify && !checksum_ready(vc)) {
+      g_warning("%s: no checksum pipeline to verify the copy with", job->input);
+      return false;
+   }
+
+   return true;
+}
+
+static const VkImageSubresourceRange color_range = {
+   .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+   .baseMipLevel = 0,
+   .levelCount = 1,
+   .baseArrayLayer = 0,
+   .layerCount = 1,
+};
+
+/* dst_image while it's written and while it's read, the same with
+ * --tune's general layout. Jobs chained to this one expect it in
+ * TRANSFER_SRC_OPTIMAL.
+ */
+static VkImageLayout
+write_layout(const struct slot *slot)
+{
+   return slot->general ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+}
 
-   vkDeviceWaitIdle(vc->device);
+static VkImageLayout
+read_layout(const struct slot *slot)
+{
+   return slot->general ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+}
+
+/* Where dst_image gets written: blitted from the source or copied from
+ * src_buffer.
+ */
+static VkPipelineStageFlags2
+upload_stage(const struct slot *slot)
+{
+   return slot->source ? VK_PIPELINE_STAGE_2_BLIT_BIT : VK_PIPELINE_STAGE_2_COPY_BIT;
+}
+
+/* One copy region per tile, in both directions. */
+static void
+tile_regions(const struct slot *slot, VkBufferImageCopy2 *regions)
+{
+   uint32_t n = 0;
+
+   for (uint32_t y = 0; y < slot->height; y += slot->tile_height) {
+      for (uint32_t x = 0; x < slot->width; x += slot->tile_width) {
+         regions[n++] = (VkBufferImageCopy2) {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_IMAGE_COPY_2,
+            .bufferOffset = (VkDeviceSize) y * slot->pitch + x * 4,
+            .bufferRowLength = slot->pitch / 4,
+            .bufferImageHeight = slot->height,
+            .imageSubresource = {
+               .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+               .mipLevel = 0,
+               .baseArrayLayer = 0,
+               .layerCount = 1,
+            },
+            .imageOffset = { x, y, 0, },
+            .imageExtent = {
+               MIN(slot->tile_width, slot->width - x),
+               MIN(slot->tile_height, slot->height - y),
+               1
+            },
+         };
+      }
+   }
+}
+
+/* The crops are packed one after the other in the readback buffer. */
+static void
+crop_regions(const struct slot *slot, VkBufferImageCopy2 *regions)
+{
+   VkDeviceSize offset = 0;
+
+   for (unsigned i = 0; i < slot->n_crops; i++) {
+      const struct rect *r = &slot->crops[i];
+
+      regions[i] = (VkBufferImageCopy2) {
+         .sType = VK_STRUCTURE_TYPE_BUFFER_IMAGE_COPY_2,
+         .bufferOffset = offset,
+         .bufferRowLength = r->width,
+         .bufferImageHeight = r->height,
+         .imageSubresource = {
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .mipLevel = 0,
+            .baseArrayLayer = 0,
+            .layerCount = 1,
+         },
+         .imageOffset = { r->x, r->y, 0, },
+         .imageExtent = { r->width, r->height, 1 },
+      };
+      offset += (VkDeviceSize) r->width * r->height * 4;
+   }
+}
+
+/* Where the scaled copies start in the readback buffer, after the crops. */
+static VkDeviceSize
+scales_offset(const struct slot *slot)
+{
+   VkDeviceSize offset = slot->n_crops > 0 ? 0 : slot->size;
+
+   for (unsigned i = 0; i < slot->n_crops; i++)
+      offset += (VkDeviceSize) slot->crops[i].width * slot->crops[i].height * 4;
+
+   return offset;
+}
+
+/* Blits dst_image, in read_layout(), to every size one below the other
+ * in scale_image, which record_readback() put in TRANSFER_DST_OPTIMAL,
+ * and reads them all back.
+ */
+static void
+record_scales(struct data *vc, struct slot *slot)
+{
+   VkCommandBuffer cmd_buffer = slot->cmd_buffer;
+   VkImageBlit2 *blits = g_new(VkImageBlit2, slot->n_scales);
+   VkBufferImageCopy2 *regions = g_new(VkBufferImageCopy2, slot->n_scales);
+   VkDeviceSize offset = scales_offset(slot);
+   const VkImageSubresourceLayers subresource = {
+      .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .mipLevel = 0,
+      .baseArrayLayer = 0,
+      .layerCount = 1,
+   };
+   int32_t y = 0;
+
+   for (unsigned i = 0; i < slot->n_scales; i++) {
+      const struct rect *r = &slot->scales[i];
+
+      blits[i] = (VkImageBlit2) {
+         .sType = VK_STRUCTURE_TYPE_IMAGE_BLIT_2,
+         .srcSubresource = subresource,
+         .srcOffsets = { { 0, 0, 0 }, { slot->width, slot->height, 1 } },
+         .dstSubresource = subresource,
+         .dstOffsets = { { 0, y, 0 }, { r->width, y + r->height, 1 } },
+      };
+      regions[i] = (VkBufferImageCopy2) {
+         .sType = VK_STRUCTURE_TYPE_BUFFER_IMAGE_COPY_2,
+         .bufferOffset = offset,
+         .bufferRowLength = r->width,
+         .bufferImageHeight = r->height,
+         .imageSubresource = subresource,
+         .imageOffset = { 0, y, 0, },
+         .imageExtent = { r->width, r->height, 1 },
+      };
+      y += r->height;
+      offset += (VkDeviceSize) r->width * r->height * 4;
+   }
+
+   cmd_blit_image(vc, cmd_buffer,
+                  &(const VkBlitImageInfo2) {
+                     .sType = VK_STRUCTURE_TYPE_BLIT_IMAGE_INFO_2,
+                     .srcImage = slot->dst_image,
+                     .srcImageLayout = read_layout(slot),
+                     .dstImage = slot->scale_image,
+                     .dstImageLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                     .regionCount = slot->n_scales,
+                     .pRegions = blits,
+                     .filter = VK_FILTER_LINEAR,
+                  });
+
+   cmd_pipeline_barrier(vc, cmd_buffer,
+                        &(const VkDependencyInfo) {
+                           .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                           .imageMemoryBarrierCount = 1,
+                           .pImageMemoryBarriers = &(const VkImageMemoryBarrier2) {
+                              .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                              .srcStageMask = VK_PIPELINE_STAGE_2_BLIT_BIT,
+                              .srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                              .dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+                              .dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT,
+                              .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                              .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                              .image = slot->scale_image,
+                              .subresourceRange = color_range,
+                           },
+                        });
+
+   cmd_copy_image_to_buffer(vc, cmd_buffer,
+                            &(const VkCopyImageToBufferInfo2) {
+                               .sType = VK_STRUCTURE_TYPE_COPY_IMAGE_TO_BUFFER_INFO_2,
+                               .srcImage = slot->scale_image,
+                               .srcImageLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                               .dstBuffer = slot->readback_buffer,
+                               .regionCount = slot->n_scales,
+                               .pRegions = regions,
+                            });
+
+   g_free(blits);
+   g_free(regions);
+}
+
+static void
+record_readback(struct data *vc, struct slot *slot, uint32_t n_regions, const VkBufferImageCopy2 *regions)
+{
+   VkCommandBuffer cmd_buffer = slot->cmd_buffer;
+   VkBufferImageCopy2 *crops = NULL;
+   bool scales = slot->readback && slot->n_scales > 0;
+
+   if (!slot->readback) {
+      n_regions = 0;
+   } else if (slot->n_crops > 0) {
+      crops = g_new(VkBufferImageCopy2, slot->n_crops);
+      crop_regions(slot, crops);
+      n_regions = slot->n_crops;
+      regions = crops;
+   }
+
+   /* Only a readback to the buffer the upload read from, or after the
+    * clear of a sparse image's output, has anything to wait for.
+    */
+   bool reused = slot->readback_buffer == slot->src_buffer && !slot->source;
+   const VkBufferMemoryBarrier2 buffer_barrier = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+      .srcStageMask = sparse_images ? VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT : VK_PIPELINE_STAGE_2_COPY_BIT,
+      .srcAccessMask = sparse_images ? VK_ACCESS_2_TRANSFER_WRITE_BIT : VK_ACCESS_2_NONE,
+      .dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+      .dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+      .buffer = slot->readback_buffer,
+      .offset = 0,
+      .size = VK_WHOLE_SIZE,
+   };
+   const VkImageMemoryBarrier2 image_barriers[] = {
+      {
+         .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+         .srcStageMask = upload_stage(slot),
+         .srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+         /* The blits are the scaled copies and the jobs reading this one's
+          * result, later in submission order.
+          */
+         .dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT | VK_PIPELINE_STAGE_2_BLIT_BIT,
+         .dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT,
+         .oldLayout = write_layout(slot),
+         .newLayout = read_layout(slot),
+         .image = slot->dst_image,
+         .subresourceRange = color_range,
+      },
+      {
+         .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+         .srcStageMask = VK_PIPELINE_STAGE_2_NONE,
+         .srcAccessMask = VK_ACCESS_2_NONE,
+         .dstStageMask = VK_PIPELINE_STAGE_2_BLIT_BIT,
+         .dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+         .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+         .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+         .image = slot->scale_image,
+         .subresourceRange = color_range,
+      },
+   };
+
+   /* The scaled copies' target is made ready along with the source. */
+   cmd_pipeline_barrier(vc, cmd_buffer,
+                        &(const VkDependencyInfo) {
+                           .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                           .bufferMemoryBarrierCount = slot->readback && (reused || sparse_images) ? 1 : 0,
+                           .pBufferMemoryBarriers = &buffer_barrier,
+                           .imageMemoryBarrierCount = scales ? 2 : 1,
+                           .pImageMemoryBarriers = image_barriers,
+                        });
+
+   /* Without a readback, the transition is still what the jobs blitting
+    * from the image expect.
+    */
+   if (n_regions > 0) {
+      cmd_copy_image_to_buffer(vc, cmd_buffer,
+                               &(const VkCopyImageToBufferInfo2) {
+                                  .sType = VK_STRUCTURE_TYPE_COPY_IMAGE_TO_BUFFER_INFO_2,
+                                  .srcImage = slot->dst_image,
+                                  .srcImageLayout = read_layout(slot),
+                                  .dstBuffer = slot->readback_buffer,
+                                  .regionCount = n_regions,
+                                  .pRegions = regions,
+                               });
+   }
+   if (scales)
+      record_scales(vc, slot);
+
+   /* For slot_write_output(), once the fence signals. */
+   if (slot->readback) {
+      cmd_pipeline_barrier(vc, cmd_buffer,
+                           &(const VkDependencyInfo) {
+                              .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                              .bufferMemoryBarrierCount = 1,
+                              .pBufferMemoryBarriers = &(const VkBufferMemoryBarrier2) {
+                                 .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+                                 .srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+                                 .srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                                 .dstStageMask = VK_PIPELINE_STAGE_2_HOST_BIT,
+                                 .dstAccessMask = VK_ACCESS_2_HOST_READ_BIT,
+                                 .buffer = slot->readback_buffer,
+                                 .offset = 0,
+                                 .size = VK_WHOLE_SIZE,
+                              },
+                           });
+   }
+
+   g_free(crops);
+}
+
+static void
+record_commands(struct data *vc, struct slot *slot)
+{
+   VkCommandBuffer cmd_buffer = slot->cmd_buffer;
+   uint32_t n_regions = ((slot->width + slot->tile_width - 1) / slot->tile_width) *
+                        ((slot->height + slot->tile_height - 1) / slot->tile_height);
+   VkBufferImageCopy2 *regions;
+
+   /* Only the resident blocks of a sparse image are copied, both ways. */
+   if (sparse_images) {
+      n_regions = slot->n_blocks;
+      regions = g_memdup2(slot->blocks, n_regions * sizeof(VkBufferImageCopy2));
+   } else {
+      regions = g_new(VkBufferImageCopy2, n_regions);
+      tile_regions(slot, regions);
+   }
+
+   /* A resident image is left as the last frame's commands left it, and
+    * has to be done being read by them. Otherwise there's nothing to wait
+    * for: the host writes to src_buffer are visible to the submission.
+    */
+   VkImageLayout old_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+   VkPipelineStageFlags2 readers = VK_PIPELINE_STAGE_2_NONE;
+   uint32_t owner = vc->queue_family;
+   if (slot->resident) {
+      old_layout = slot->layout;
+      readers = gpu_verify ? VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT :
+                             VK_PIPELINE_STAGE_2_COPY_BIT | VK_PIPELINE_STAGE_2_BLIT_BIT;
+      /* Given back by the checksum, see checksum_record(). */
+      if (gpu_verify)
+         owner = vc->compute_family;
+   }
+
+   /* An image staying in GENERAL doesn't need a transition either, the
+    * jobs before, which read it, are done before the slot is reused.
+    */
+   bool transition = !slot->general || slot->layout != VK_IMAGE_LAYOUT_GENERAL;
+
+   vc->vk.BeginCommandBuffer(cmd_buffer,
+                             &(VkCommandBufferBeginInfo) {
+                                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                                .flags = 0
+                             });
+
+   if (slot->timestamps) {
+      vc->vk.CmdResetQueryPool(cmd_buffer, slot->timestamps, 0, 2);
+      cmd_write_timestamp(vc, cmd_buffer, VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT, slot->timestamps, 0);
+   }
+
+   if (transition) {
+      cmd_pipeline_barrier(vc, cmd_buffer,
+                           &(const VkDependencyInfo) {
+                              .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                              .imageMemoryBarrierCount = 1,
+                              .pImageMemoryBarriers = &(const VkImageMemoryBarrier2) {
+                                 .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                                 .srcStageMask = readers,
+                                 .srcAccessMask = VK_ACCESS_2_NONE,
+                                 .dstStageMask = upload_stage(slot),
+                                 .dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                                 .oldLayout = old_layout,
+                                 .newLayout = write_layout(slot),
+                                 .srcQueueFamilyIndex = owner,
+                                 .dstQueueFamilyIndex = vc->queue_family,
+                                 .image = slot->dst_image,
+                                 .subresourceRange = color_range,
+                              },
+                           });
+   }
+
+   /* The rest of the output is left empty. */
+   if (sparse_images)
+      vc->vk.CmdFillBuffer(cmd_buffer, slot->readback_buffer, 0, VK_WHOLE_SIZE, 0);
+
+   if (slot->source) {
+      /* The source was left in TRANSFER_SRC_OPTIMAL by the job producing it,
+       * earlier in submission order on the same queue.
+       */
+      const struct gpu_image *source = slot->job->source;
+      const VkImageSubresourceLayers subresource = {
+         .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+         .mipLevel = 0,
+         .baseArrayLayer = 0,
+         .layerCount = 1,
+      };
+
+      cmd_blit_image(vc, cmd_buffer,
+                     &(const VkBlitImageInfo2) {
+                        .sType = VK_STRUCTURE_TYPE_BLIT_IMAGE_INFO_2,
+                        .srcImage = slot->source,
+                        .srcImageLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                        .dstImage = slot->dst_image,
+                        .dstImageLayout = write_layout(slot),
+                        .regionCount = 1,
+                        .pRegions = &(const VkImageBlit2) {
+                           .sType = VK_STRUCTURE_TYPE_IMAGE_BLIT_2,
+                           .srcSubresource = subresource,
+                           .srcOffsets = { { 0, 0, 0 }, { source->width, source->height, 1 } },
+                           .dstSubresource = subresource,
+                           .dstOffsets = { { 0, 0, 0 }, { slot->width, slot->height, 1 } },
+                        },
+                        .filter = VK_FILTER_LINEAR,
+                     });
+   } else {
+      /* Only the tiles that changed with --delta. */
+      uint32_t n_uploads = delta_uploads ? slot->n_dirty : n_regions;
+
+      if (n_uploads > 0) {
+         cmd_copy_buffer_to_image(vc, cmd_buffer,
+                                  &(const VkCopyBufferToImageInfo2) {
+                                     .sType = VK_STRUCTURE_TYPE_COPY_BUFFER_TO_IMAGE_INFO_2,
+                                     .srcBuffer = slot->src_buffer,
+                                     .dstImage = slot->dst_image,
+                                     .dstImageLayout = write_layout(slot),
+                                     .regionCount = n_uploads,
+                                     .pRegions = delta_uploads ? slot->dirty : regions,
+                                  });
+      }
+   }
+
+   /* The checksum takes the image over in a command buffer of its own,
+    * released here if it runs on another family.
+    */
+   if (gpu_verify && vc->compute_family != vc->queue_family) {
+      cmd_pipeline_barrier(vc, cmd_buffer,
+                           &(const VkDependencyInfo) {
+                              .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                              .imageMemoryBarrierCount = 1,
+                              .pImageMemoryBarriers = &(const VkImageMemoryBarrier2) {
+                                 .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                                 .srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+                                 .srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                                 .dstStageMask = VK_PIPELINE_STAGE_2_NONE,
+                                 .dstAccessMask = VK_ACCESS_2_NONE,
+                                 .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                 .newLayout = VK_IMAGE_LAYOUT_GENERAL,
+                                 .srcQueueFamilyIndex = vc->queue_family,
+                                 .dstQueueFamilyIndex = vc->compute_family,
+                                 .image = slot->dst_image,
+                                 .subresourceRange = color_range,
+                              },
+                           });
+   } else if (!gpu_verify) {
+      record_readback(vc, slot, n_regions, regions);
+   }
+
+   if (slot->timestamps)
+      cmd_write_timestamp(vc, cmd_buffer, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, slot->timestamps, 1);
+
+   vc->vk.EndCommandBuffer(cmd_buffer);
+   g_free(regions);
+
+   if (gpu_verify)
+      checksum_record(vc, slot);
+
+   /* The commands transitioning a new image to GENERAL are only for its
+    * first job, the next ones are recorded again without.
+    */
+   slot->recorded = transition ? !slot->general : true;
+   slot->resident = delta_uploads && !slot->source;
+   slot->layout = gpu_verify ? VK_IMAGE_LAYOUT_GENERAL : read_layout(slot);
+}
+
+/* The slot's own queue, unless the job reads the result of another one,
+ * which has to be submitted first on the same queue.
+ */
+static VkQueue
+slot_queue(const struct slot *slot)
+{
+   return slot->source ? slot->job->source->queue : slot->queue;
+}
+
+/* With --verify, the checksum is a second submission on the compute
+ * queue, so that the copies of the next job don't queue up behind it. It
+ * signals the fence in place of the upload.
+ */
+VkResult
+slot_submit(struct data *vc, struct slot *slot)
+{
+   if (!slot->recorded)
+      record_commands(vc, slot);
+
+   VkProtectedSubmitInfo prot_submit = {
+      .sType = VK_STRUCTURE_TYPE_PROTECTED_SUBMIT_INFO,
+      .protectedSubmit = image_protected,
+   };
+   VkResult res = vc->vk.QueueSubmit(slot_queue(slot), 1,
+                                     &(const VkSubmitInfo) {
+                                        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                                        .pNext = &prot_submit,
+                                        /* The binds of sparse_bind() come first. */
+                                        .waitSemaphoreCount = sparse_images ? 1 : 0,
+                                        .pWaitSemaphores = &slot->bound,
+                                        .pWaitDstStageMask = &(const VkPipelineStageFlags) { VK_PIPELINE_STAGE_TRANSFER_BIT },
+                                        .commandBufferCount = 1,
+                                        .pCommandBuffers = &slot->cmd_buffer,
+                                        .signalSemaphoreCount = gpu_verify ? 1 : 0,
+                                        .pSignalSemaphores = &slot->uploaded,
+                                     },
+                                     gpu_verify ? VK_NULL_HANDLE : slot->fence);
+   if (res != VK_SUCCESS || !gpu_verify)
+      return res;
+
+   return vc->vk.QueueSubmit(slot->compute_queue, 1,
+                             &(const VkSubmitInfo) {
+                                .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                                .pNext = &prot_submit,
+                                .waitSemaphoreCount = 1,
+                                .pWaitSemaphores = &slot->uploaded,
+                                .pWaitDstStageMask = &(const VkPipelineStageFlags) { VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT },
+                                .commandBufferCount = 1,
+                                .pCommandBuffers = &slot->compute_cmd_buffer,
+                             },
+                             slot->fence);
+}
+
+/* Whether slot_wait() would return immediately, including with an error. */
+bool
+slot_poll(struct data *vc, struct slot *slot)
+{
+   return vc->vk.GetFenceStatus(vc->device, slot->fence) != VK_NOT_READY;
+}
+
+/* Adds the time between the timestamps of the job that just completed,
+ * and the time since the previous one ended if it started later.
+ */
+static void
+add_gpu_time(struct data *vc, struct slot *slot)
+{
+   uint64_t t[2];
+
+   if (vc->vk.GetQueryPoolResults(vc->device, slot->timestamps, 0, 2, sizeof(t), t, sizeof(t[0]),
+                                  VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+      return;
+
+   if (vc->gpu_time.jobs > 0 && t[0] > vc->gpu_time.last_end)
+      vc->gpu_time.idle += t[0] - vc->gpu_time.last_end;
+   vc->gpu_time.busy += t[1] - t[0];
+   vc->gpu_time.last_end = MAX(vc->gpu_time.last_end, t[1]);
+   vc->gpu_time.jobs++;
+}
+
+VkResult
+slot_wait(struct data *vc, struct slot *slot)
+{
+   VkResult res = vc->vk.WaitForFences(vc->device, 1, &slot->fence, VK_TRUE, UINT64_MAX);
+   if (res != VK_SUCCESS)
+      return res;
+
+   if (slot->timestamps)
+      add_gpu_time(vc, slot);
+
+   return vc->vk.ResetFences(vc->device, 1, &slot->fence);
+}
+
+/* One file written by slot_write_output(). */
+struct output {
+   GdkPixbuf *pixbuf;
+   char *path;
+
+   gchar *buffer;
+   gsize length;
+   bool ok;
+};
+
+struct encode_batch {
+   GMutex lock;
+   GCond cond;
+   unsigned pending;
+};
+
+/* Only used by the submission thread, which writes all the outputs. */
+static GThreadPool *encoder;
+
+static void
+encode_output(struct output *out)
+{
+   GError *error = NULL;
+
+   /* g_file_set_contents() renames the output into place once complete,
+    * so a file named in the journal is never a partial one.
+    */
+   out->ok = gdk_pixbuf_save_to_buffer(out->pixbuf, &out->buffer, &out->length, "png", &error, NULL) &&
+             g_file_set_contents(out->path, out->buffer, out->length, &error);
+   if (!out->ok) {
+      g_warning("Could not write output file: %s", error->message);
+      g_error_free(error);
+   }
+}
+
+static void
+encode_task(gpointer data, gpointer user_data)
+{
+   struct encode_batch *batch = user_data;
+
+   encode_output(data);
+
+   g_mutex_lock(&batch->lock);
+   if (--batch->pending == 0)
+      g_cond_signal(&batch->cond);
+   g_mutex_unlock(&batch->lock);
+}
+
+/* PNG compression dominates the time spent on the host, so the outputs of
+ * a job are encoded in parallel.
+ */
+static void
+encode_outputs(struct output *outputs, unsigned n_outputs)
+{
+   static struct encode_batch batch;
+
+   if (n_outputs == 1) {
+      encode_output(&outputs[0]);
+      return;
+   }
+
+   if (!encoder) {
+      g_mutex_init(&batch.lock);
+      g_cond_init(&batch.cond);
+      encoder = g_thread_pool_new(encode_task, &batch, g_get_num_processors(), FALSE, NULL);
+   }
+
+   batch.pending = n_outputs;
+   for (unsigned i = 0; i < n_outputs; i++)
+      g_thread_pool_push(encoder, &outputs[i], NULL);
+
+   g_mutex_lock(&batch.lock);
+   while (batch.pending > 0)
+      g_cond_wait(&batch.cond, &batch.lock);
+   g_mutex_unlock(&batch.lock);
+}
+
+/* "out.png" → "out-<suffix>.png", outputs that aren't written ("-" or
+ * NULL) stay as they are.
+ */
+char *
+output_name_with_suffix(const char *output, const char *suffix)
+{
+   if (!output || !strcmp(output, "-"))
+      return g_strdup(output);
+
+   const char *dot = strrchr(output, '.');
+   const char *slash = strrchr(output, '/');
+
+   if (!dot || (slash && dot < slash))
+      dot = output + strlen(output);
+
+   return g_strdup_printf("%.*s-%s%s", (int) (dot - output), output, suffix, dot);
+}
+
+/* "out.png" → "out-WxH+X+Y.png", or "out-WxH.png" for a scaled copy */
+static char *
+variant_output_name(const char *output, const struct rect *r, bool scaled)
+{
+   char *geometry = scaled ? g_strdup_printf("%ux%u", r->width, r->height) :
+                             g_strdup_printf("%ux%u+%u+%u", r->width, r->height, r->x, r->y);
+   char *name = output_name_with_suffix(output, geometry);
+
+   g_free(geometry);
+
+   return name;
+}
+
+bool
+slot_write_output(struct data *vc, struct slot *slot)
+{
+   if (gpu_verify)
+      return checksum_verify(slot);
+   if (!slot->readback)
+      return true;
+
+   struct job *job = slot->job;
+   unsigned n_outputs = MAX(slot->n_crops, 1) + slot->n_scales;
+   struct output *outputs = g_new0(struct output, n_outputs);
+   const guint8 *pixels = slot->readback_map;
+   unsigned n = 0;
+
+   if (slot->n_crops == 0) {
+      outputs[n].pixbuf = gdk_pixbuf_new_from_data(slot->readback_map,
+                                                   GDK_COLORSPACE_RGB,
+                                                   true,
+                                                   8,
+                                                   slot->width,
+                                                   slot->height,
+                                                   slot->pitch,
+                                                   NULL,
+                                                   NULL);
+      outputs[n++].path = g_strdup(job->output);
+      pixels += slot->size;
+   }
+
+   /* Same order as in the readback buffer: the crops, then the scaled copies. */
+   for (unsigned i = 0; i < slot->n_crops + slot->n_scales; i++) {
+      bool scaled = i >= slot->n_crops;
+      const struct rect *r = scaled ? &slot->scales[i - slot->n_crops] : &slot->crops[i];
+
+      outputs[n].pixbuf = gdk_pixbuf_new_from_data(pixels, GDK_COLORSPACE_RGB, true, 8,
+                                                   r->width, r->height, r->width * 4,
+                                                   NULL, NULL);
+      outputs[n++].path = !scaled && slot->n_crops == 1 ? g_strdup(job->output) :
+                                                          variant_output_name(job->output, r, scaled);
+      pixels += (gsize) r->width * r->height * 4;
+   }
+
+   encode_outputs(outputs, n_outputs);
+
+   GChecksum *checksum = job->checksum ? g_checksum_new(G_CHECKSUM_SHA256) : NULL;
+   bool ret = true;
+
+   for (unsigned i = 0; i < n_outputs; i++) {
+      ret = ret && outputs[i].ok;
+      if (checksum && ret)
+         g_checksum_update(checksum, (const guchar *) outputs[i].buffer, outputs[i].length);
+
+      g_free(outputs[i].buffer);
+      g_free(outputs[i].path);
+      g_object_unref(G_OBJECT(outputs[i].pixbuf));
+   }
+   g_free(outputs);
+
+   if (checksum) {
+      if (ret)
+         job->output_hash = g_strdup(g_checksum_get_string(checksum));
+      g_checksum_free(checksum);
+   }
+
+   return ret;
+}
+
+/* Hands dst_image over to the registry once submitted, for the jobs
+ * reading this one's result. The slot gets a new image with the next job.
+ */
+void
+slot_export_image(struct data *vc, struct slot *slot, const char *id, unsigned refs)
+{
+   /* One more reference for the job itself, until it retires. */
+   registry_add(vc, id, slot->job->input, slot->dst_image, slot->dst_image_mem, slot_queue(slot),
+                slot->width, slot->height, refs + 1);
+
+   slot->dst_image = VK_NULL_HANDLE;
+   slot->dst_image_mem = VK_NULL_HANDLE;
+   slot->layout = VK_IMAGE_LAYOUT_UNDEFINED;
+   slot->recorded = false;
+   delta_release(slot);
+}
+
+void
+slot_fini(struct data *vc, struct slot *slot)
+{
+   slot_release_images(vc, slot);
+   g_free(slot->crops);
+   g_free(slot->scales);
+   vc->vk.DestroyFence(vc->device, slot->fence, NULL);
+   vc->vk.DestroyQueryPool(vc->device, slot->timestamps, NULL);
+   vc->vk.FreeCommandBuffers(vc->device, vc->cmd_pool, 1, &slot->cmd_buffer);
+   if (slot->compute_cmd_buffer)
+      vc->vk.FreeCommandBuffers(vc->device, vc->compute_pool, 1, &slot->compute_cmd_buffer);
+   vc->vk.DestroySemaphore(vc->device, slot->uploaded, NULL);
+}
+
+static void
+single_done(struct job *job, bool success, void *user_data)
+{
+   bool *failed = user_data;
+
+   if (!success)
+      *failed = true;
+}
+
+static void
+watch_done(struct job *job, bool success, void *user_data)
+{
+   if (success)
+      g_info("%s -> %s\n", job->input, job->output);
+}
+
+struct batch {
+   struct journal *journal;
+   unsigned done, failed;
+};
+
+static void
+batch_done(struct job *job, bool success, void *user_data)
+{
+   struct batch *batch = user_data;
+
+   if (!success) {
+      batch->failed++;
+      return;
+   }
+
+   batch->done++;
+   if (batch->journal)
+      journal_append(batch->journal, job->id, job->output_hash);
+}
+
+/* Drops the jobs the journal already has, returns how many. Results on the
+ * GPU don't outlive the process: a job is run again if one that isn't done
+ * starts from it, directly or not.
+ */
+static unsigned
+skip_done_jobs(GPtrArray *jobs, struct journal *journal)
+{
+   GHashTable *needed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+   unsigned skipped = 0;
+   bool changed = true;
+
+   while (changed) {
+      changed = false;
+      for (unsigned i = 0; i < jobs->len; i++) {
+         struct job *job = g_ptr_array_index(jobs, i);
+         uint32_t width, height;
+         char *id;
+
+         if ((journal_contains(journal, job->id) && !g_hash_table_contains(needed, job->id)) ||
+             !chain_input(job->input, &id, &width, &height))
+            continue;
+
+         if (g_hash_table_add(needed, id))
+            changed = true;
+      }
+   }
+
+   for (unsigned i = jobs->len; i-- > 0; ) {
+      struct job *job = g_ptr_array_index(jobs, i);
+
+      if (journal_contains(journal, job->id) && !g_hash_table_contains(needed, job->id)) {
+         job_free(g_ptr_array_remove_index(jobs, i));
+         skipped++;
+      }
+   }
+
+   g_hash_table_destroy(needed);
+
+   return skipped;
+}
+
+static int
+run_batch(struct data *vc, GPtrArray *jobs, struct journal *journal)
+{
+   struct batch batch = { .journal = journal };
+   struct pipeline *p = pipeline_create(vc, depth, batch_done, &batch);
+
+   for (unsigned i = 0; i < jobs->len; i++) {
+      struct job *job = g_ptr_array_index(jobs, i);
+
+      job->checksum = journal != NULL;
+      pipeline_queue(p, job);
+   }
+
+   pipeline_finish(p);
+
+   g_info("%u jobs done, %u failed\n", batch.done, batch.failed);
+
+   return batch.failed ? 1 : 0;
+}
+
+/* The memory a job takes, as in slot_prepare(): the staging buffer with
+ * its tuned pitch, and a readback buffer of its own when the crops and
+ * scaled copies don't fit in it or with --sparse. The memory bound to the
+ * blocks of a sparse image counts as if all of them had content. Jobs are
+ * assumed to be about the size of job, and to have the same variants.
+ * Returns 0 if its input can't be read.
+ */
+static unsigned
+budget_depth(struct data *vc, const struct job *job)
+{
+   int width, height;
+   struct tuning t;
+
+   if (job->input[0] == '@' || !gdk_pixbuf_get_file_info(job->input, &width, &height))
+      return 0;
+
+   tuning_lookup(vc, width, height, &t);
+
+   guint64 size = (guint64) staging_pitch(vc, width, t.padded) * height;
+   guint64 readback = job->n_crops > 0 ? 0 : size;
+
+   for (unsigned i = 0; i < job->n_crops; i++)
+      readback += (guint64) job->crops[i].width * job->crops[i].height * 4;
+   for (unsigned i = 0; i < job->n_scales; i++)
+      readback += (guint64) job->scales[i].width * job->scales[i].height * 4;
+
+   guint64 total = size;
+   if (!gpu_verify && (readback > size || sparse_images))
+      total += readback;
+   if (sparse_images)
+      total += (guint64) width * height * 4;
+
+   return CLAMP((guint64) staging_budget * 1024 * 1024 / total, 1, MAX_BUDGET_DEPTH);
+}
+
+/* --crop and --scale apply to the jobs that don't name their own. */
+static void
+add_variant_args(struct job *job)
+{
+   bool crops = job->n_crops == 0 && crop_args;
+   bool scales = job->n_scales == 0 && scale_args;
+   struct rect rect;
+
+   for (unsigned i = 0; crops && crop_args[i]; i++) {
+      rect_parse(crop_args[i], &rect);
+      job_add_crop(job, &rect);
+   }
+   for (unsigned i = 0; scales && scale_args[i]; i++) {
+      size_parse(scale_args[i], &rect);
+      job_add_scale(job, &rect);
+   }
+}
+
+struct startup {
+   struct job *job;
+   gint64 decode_time;
+};
+
+static gpointer
+decode_thread(gpointer data)
+{
+   struct startup *startup = data;
+   gint64 start = g_get_monotonic_time();
+
+   job_decode(startup->job);
+   startup->decode_time = g_get_monotonic_time() - start;
+
+   return NULL;
+}
+
+static void
+print_startup_times(struct data *vc, const struct startup *startup, gint64 ready)
+{
+   g_printerr("startup: loader %.2f ms, instance %.2f ms, enumeration %.2f ms, device %.2f ms",
+              vc->init_time.loader / 1000.0,
+              vc->init_time.instance / 1000.0,
+              vc->init_time.enumeration / 1000.0,
+              vc->init_time.device / 1000.0);
+   if (startup->job)
+      g_printerr(", decode %.2f ms (concurrent)", startup->decode_time / 1000.0);
+   g_printerr(", ready after %.2f ms\n", ready / 1000.0);
+}
+
+static void
+print_gpu_times(struct data *vc)
+{
+   double ms = vc->timestamp_period / 1e6;
+
+   if (vc->gpu_time.jobs == 0)
+      return;
+
+   g_printerr("gpu: %u jobs, busy %.2f ms, idle between jobs %.2f ms\n",
+              vc->gpu_time.jobs, vc->gpu_time.busy * ms, vc->gpu_time.idle * ms);
+}
+
+int
+main(int argc, char *argv[])
+{
+   gint64 start = g_get_monotonic_time();
+   struct data data = {}, *vc = &data;
+   struct startup startup = { NULL, };
+   GThread *decode = NULL;
+   struct pipeline *p;
+   GOptionContext *context;
+   GError *error = NULL;
+   GPtrArray *jobs = NULL;
+   struct journal *journal = NULL;
+   int ret = 0;
+
+   context = g_option_context_new("[input_file output_file]");
+   g_option_context_add_main_entries(context, entries, NULL);
+   if (!g_option_context_parse(context, &argc, &argv, &error))
+      g_error("%s", error->message);
+   g_option_context_free(context);
+
+   if (depth < 0)
+      g_error("--depth can't be negative");
+   if (staging_budget < 0)
+      g_error("--staging-budget can't be negative");
+   for (unsigned i = 0; crop_args && crop_args[i]; i++) {
+      struct rect crop;
+
+      if (!rect_parse(crop_args[i], &crop))
+         g_error("Invalid --crop %s, expected WxH+X+Y", crop_args[i]);
+   }
+   for (unsigned i = 0; scale_args && scale_args[i]; i++) {
+      struct rect size;
+
+      if (!size_parse(scale_args[i], &size))
+         g_error("Invalid --scale %s, expected WxH", scale_args[i]);
+   }
+   delta_uploads = delta;
+   if (verify) {
+      /* Storage images, and thus the checksum pass, can't be protected. */
+      gpu_verify = true;
+      image_protected = false;
+   }
+   if (sparse) {
+      /* Neither can sparse ones. */
+      if (verify || delta || crop_args || scale_args)
+         g_error("--sparse only writes whole images, without --verify or --delta");
+      sparse_images = true;
+      image_protected = false;
+   }
+   if (workers > 0 && !manifest_path)
+      g_error("--workers requires --manifest");
+   /* The estimate needs the first input and this process' device. */
+   if (staging_budget > 0 && (watch_dir || listen_address || coordinate || workers > 0 || tune_input))
+      g_error("--staging-budget only applies to a single file or --manifest, without --workers or --coordinate");
+
+   if (watch_dir) {
+      if (!output_dir)
+         g_error("--watch requires --output-dir");
+   } else if (manifest_path) {
+      jobs = manifest_load(manifest_path, &error);
+      if (!jobs)
+         g_error("%s", error->message);
+      for (unsigned i = 0; i < jobs->len; i++)
+         add_variant_args(g_ptr_array_index(jobs, i));
+
+      if (journal_path) {
+         /* The --workers supervisor keeps forking, no threads there. */
+         journal = journal_open(journal_path, workers == 0, &error);
+         if (!journal)
+            g_error("%s", error->message);
+
+         unsigned skipped = skip_done_jobs(jobs, journal);
+         if (skipped)
+            g_info("Skipping %u jobs already in %s\n", skipped, journal_path);
+      }
+
+      unsigned n_chained;
+      if (!manifest_link(jobs, &n_chained, &error))
+         g_error("%s", error->message);
+      /* The results stay on this process' device. */
+      if (n_chained > 0 && (coordinate || workers > 0 || verify || sparse))
+         g_error("Chained jobs can't run with --coordinate, --workers, --verify or --sparse");
+   } else if (coordinate) {
+      g_error("--coordinate requires --manifest");
+   } else if (!listen_address && !tune_input && argc < 3) {
+      g_error("Require 2 arguments : input_file output_file");
+   }
+
+   if (coordinate) {
+      /* The nodes do all the Vulkan work. */
+      ret = coordinator_run(coordinate, jobs, journal);
+   } else if (workers > 0 && jobs) {
+      /* Each worker brings up its own device. */
+      ret = prefork_run(jobs, journal, workers, depth);
+   } else {
+      /* In single-shot mode, the instance and device bring-up and the
+       * decode of the input are independent: do them concurrently and
+       * only create the resources once both are done.
+       */
+      if (!listen_address && !tune_input && !watch_dir && !jobs) {
+         startup.job = job_new(NULL, argv[1], argv[2]);
+         add_variant_args(startup.job);
+         decode = g_thread_new("blit-decode", decode_thread, &startup);
+      }
+
+      init_vk(&data);
+
+      if (decode)
+         g_thread_join(decode);
+      if (timings)
+         print_startup_times(vc, &startup, g_get_monotonic_time() - start);
+
+      if (depth == 0 && staging_budget > 0) {
+         if (jobs && jobs->len > 0)
+            depth = budget_depth(vc, g_ptr_array_index(jobs, 0));
+         else if (startup.job)
+            depth = budget_depth(vc, startup.job);
+         if (depth > 0)
+            g_info("%d jobs in flight fit in %d MiB of staging memory\n", depth, staging_budget);
+      }
+
+      if (tune_input) {
+         ret = tune_run(vc, tune_input);
+      } else if (listen_address) {
+         ret = daemon_run(vc, listen_address, depth);
+      } else if (watch_dir) {
+         p = pipeline_create(vc, depth, watch_done, NULL);
+         ret = watch_run(p, watch_dir, output_dir);
+         pipeline_finish(p);
+      } else if (jobs) {
+         ret = run_batch(vc, jobs, journal);
+      } else {
+         bool failed = false;
+
+         /* Only the frames of an animation use more than one slot. */
+         p = pipeline_create(vc, depth, single_done, &failed);
+         pipeline_queue(p, startup.job);
+         pipeline_finish(p);
+         ret = failed ? 1 : 0;
+      }
+
+      if (timings)
+         print_gpu_times(vc);
+
+      /* Writes back the caches. */
+      fini_vk(&data);
+   }
 
-   write_image_output(vc, argv[2]);
+   if (jobs)
+      g_ptr_array_free(jobs, TRUE);
+   if (journal)
+      journal_close(journal);
 
-   return 0;
+   return ret;
 }
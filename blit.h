@@ -0,0 +1,594 @@
+/*
+ * Copyright © 2021 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef BLIT_H
+#define BLIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include <vulkan/vulkan.h>
+
+/* Size of the hash produced by shaders/checksum.comp, in 32-bit words. */
+#define CHECKSUM_LANES 8
+
+struct rect {
+   uint32_t x, y, width, height;
+};
+
+/* A result image kept on the GPU for the jobs reading it, see registry.c.
+ * image is VK_NULL_HANDLE once they all have, or after a device loss until
+ * the producer runs again. retired is set once the producer is done, and
+ * failed if it never got to add the image.
+ */
+struct gpu_image {
+   VkImage image;
+   VkDeviceMemory mem;
+   uint32_t width, height;
+   unsigned refcount;
+   char *input;
+   bool retired, failed;
+
+   /* The queue the producer was submitted to. The jobs reading the image
+    * go to the same one, after it in submission order.
+    */
+   VkQueue queue;
+};
+
+/* One input file going through upload → copy → readback → output file. */
+struct job {
+   char *id;
+   char *input;
+   char *output;
+
+   /* Only these parts of the result are read back and written. With more
+    * than one, each goes to its own file named after output and the crop.
+    */
+   struct rect *crops;
+   unsigned n_crops;
+
+   /* Copies of the whole result scaled to these sizes (x and y are unused),
+    * written as well, each to a file named after output and the size.
+    */
+   struct rect *scales;
+   unsigned n_scales;
+
+   /* Whether to fill output_hash with the SHA-256 of the written files. */
+   bool checksum;
+   char *output_hash;
+
+   /* With an input of "@id", the result of job id, scaled to
+    * scale_width x scale_height if they're set. keep is the number of jobs
+    * reading this one's result, and an output of "-" isn't read back. A
+    * NULL output, --tune's, is read back without being written.
+    */
+   struct gpu_image *source;
+   uint32_t scale_width, scale_height;
+   unsigned keep;
+
+   /* For whoever queued the job, typically used by the done callback. */
+   void *data;
+
+   /* Filled by the readahead threads. */
+   GdkPixbuf *pixbuf;
+   GError *error;
+   uint32_t source_hash[CHECKSUM_LANES];
+
+   /* Animated inputs are decoded to frames instead of pixbuf. Each frame
+    * goes through a job of its own, writing to output with the frame
+    * number appended, and this one completes with the last of them.
+    */
+   GPtrArray *frames;
+   struct job *parent;
+   unsigned frame, pending_frames;
+   char **frame_hashes;
+   bool frame_failed;
+
+   /* Submissions lost along with the device. */
+   unsigned lost;
+
+   /* Produces a result again for the jobs still reading it after a device
+    * loss, see registry_replay(). Nothing is reported when it completes.
+    */
+   bool replay;
+};
+
+/* Resources for one job in flight. They are kept around ("warm") and reused
+ * as long as the following jobs have the same dimensions, including the
+ * recorded command buffer.
+ */
+struct slot {
+   struct job *job;
+
+   uint32_t width, height;
+   uint32_t row_stride, size;
+
+   /* Bytes per row of the image in src_buffer, and in a full readback,
+    * padded if the tuning says so. size is that times height.
+    */
+   uint32_t pitch;
+
+   /* From the tuning of the image size, see tuning_lookup(). */
+   VkImageTiling tiling;
+   uint32_t tile_width, tile_height;
+   bool tuned_general;
+
+   VkBuffer src_buffer;
+   VkDeviceMemory src_mem;
+   void *src_map;
+
+   VkImage dst_image;
+   VkDeviceMemory dst_image_mem;
+
+   /* Only allocated when a readback doesn't fit in src_buffer. */
+   VkBuffer dst_buffer;
+   VkDeviceMemory dst_mem;
+   void *dst_map;
+   uint32_t dst_size;
+
+   /* Where the readback goes, src_buffer or dst_buffer, see
+    * prepare_readback().
+    */
+   VkBuffer readback_buffer;
+   void *readback_map;
+
+   /* What the commands were recorded for: the image to blit from instead
+    * of src_buffer, whether to read back at all and the crops packed in
+    * the readback buffer.
+    */
+   VkImage source;
+   bool readback;
+   struct rect *crops;
+   unsigned n_crops;
+   struct rect *scales;
+   unsigned n_scales;
+
+   /* The scaled copies are blitted one below the other in there, then
+    * read back after the crops.
+    */
+   VkImage scale_image;
+   VkDeviceMemory scale_mem;
+   uint32_t scale_width, scale_height;
+
+   /* With --delta, see delta.c. */
+   guint8 *prev_pixels;
+   VkBufferImageCopy2 *dirty;
+   uint32_t n_dirty;
+   bool resident;
+
+   /* With --sparse, see sparse.c: the block size, the memory bound to the
+    * resident ones and the regions to copy, which are those.
+    */
+   VkExtent3D granularity;
+   VkDeviceSize block_size;
+   int block_memory_type;
+   VkDeviceMemory block_mem, old_block_mem;
+   uint32_t n_block_mem;
+   VkBufferImageCopy2 *blocks;
+   uint32_t n_blocks;
+   VkSemaphore bound;
+
+   /* With --verify, in place of a readback. The checksum is submitted to
+    * compute_queue once the upload signals uploaded, so that it runs
+    * while the next job's copies do.
+    */
+   VkQueue compute_queue;
+   VkCommandBuffer compute_cmd_buffer;
+   VkSemaphore uploaded;
+   VkImageView view;
+   VkBuffer hash_buffer;
+   VkDeviceMemory hash_mem;
+   uint32_t *hash_map;
+   VkDescriptorPool desc_pool;
+   VkDescriptorSet desc_set;
+
+   VkQueue queue;
+   VkCommandBuffer cmd_buffer;
+   VkFence fence;
+   bool recorded;
+
+   /* Whether the commands copy to and from dst_image in GENERAL, where it
+    * then stays between jobs, and the layout they leave it in, which the
+    * next ones start from. UNDEFINED for a new image.
+    */
+   bool general;
+   VkImageLayout layout;
+
+   /* With --timings, written at the start and the end of cmd_buffer. */
+   VkQueryPool timestamps;
+};
+
+/* Entry points called through the tables of struct vk_dispatch, by level.
+ * Going through vkGetDeviceProcAddr() pointers skips the loader trampoline
+ * on every command buffer, fence and memory call.
+ */
+#define VK_GLOBAL_FUNCS(X) \
+   X(EnumerateInstanceVersion) \
+   X(CreateInstance)
+
+#define VK_INSTANCE_FUNCS(X) \
+   X(DestroyInstance) \
+   X(EnumeratePhysicalDevices) \
+   X(GetPhysicalDeviceFeatures2) \
+   X(GetPhysicalDeviceProperties2) \
+   X(GetPhysicalDeviceMemoryProperties) \
+   X(GetPhysicalDeviceFormatProperties) \
+   X(GetPhysicalDeviceQueueFamilyProperties) \
+   X(EnumerateDeviceExtensionProperties) \
+   X(CreateDevice) \
+   X(GetDeviceProcAddr)
+
+#define VK_DEVICE_FUNCS(X) \
+   X(DestroyDevice) \
+   X(GetDeviceQueue2) \
+   X(CreateCommandPool) \
+   X(DestroyCommandPool) \
+   X(AllocateCommandBuffers) \
+   X(FreeCommandBuffers) \
+   X(BeginCommandBuffer) \
+   X(EndCommandBuffer) \
+   X(CmdPipelineBarrier) \
+   X(CmdCopyBufferToImage) \
+   X(CmdCopyImageToBuffer) \
+   X(CmdBlitImage) \
+   X(CmdResetQueryPool) \
+   X(CmdWriteTimestamp) \
+   X(CmdFillBuffer) \
+   X(CmdBindPipeline) \
+   X(CmdBindDescriptorSets) \
+   X(CmdDispatch) \
+   X(CreatePipelineCache) \
+   X(DestroyPipelineCache) \
+   X(GetPipelineCacheData) \
+   X(CreateComputePipelines) \
+   X(DestroyPipeline) \
+   X(CreateShaderModule) \
+   X(DestroyShaderModule) \
+   X(CreateDescriptorSetLayout) \
+   X(DestroyDescriptorSetLayout) \
+   X(CreatePipelineLayout) \
+   X(DestroyPipelineLayout) \
+   X(CreateDescriptorPool) \
+   X(DestroyDescriptorPool) \
+   X(AllocateDescriptorSets) \
+   X(UpdateDescriptorSets) \
+   X(CreateImageView) \
+   X(DestroyImageView) \
+   X(QueueSubmit) \
+   X(QueueBindSparse) \
+   X(CreateSemaphore) \
+   X(DestroySemaphore) \
+   X(CreateQueryPool) \
+   X(DestroyQueryPool) \
+   X(GetQueryPoolResults) \
+   X(CreateFence) \
+   X(DestroyFence) \
+   X(GetFenceStatus) \
+   X(WaitForFences) \
+   X(ResetFences) \
+   X(CreateBuffer) \
+   X(DestroyBuffer) \
+   X(CreateImage) \
+   X(DestroyImage) \
+   X(GetBufferMemoryRequirements) \
+   X(GetImageMemoryRequirements) \
+   X(GetImageSparseMemoryRequirements) \
+   X(AllocateMemory) \
+   X(FreeMemory) \
+   X(BindBufferMemory) \
+   X(BindImageMemory) \
+   X(MapMemory) \
+   X(UnmapMemory)
+
+/* Only loaded when the device has synchronization2 and copy_commands2,
+ * see the cmd_*() wrappers.
+ */
+#define VK_SYNC2_FUNCS(X) \
+   X(CmdPipelineBarrier2KHR) \
+   X(CmdCopyBufferToImage2KHR) \
+   X(CmdCopyImageToBuffer2KHR) \
+   X(CmdBlitImage2KHR) \
+   X(CmdWriteTimestamp2KHR)
+
+struct vk_dispatch {
+#define VK_DISPATCH_ENTRY(name) PFN_vk##name name;
+   VK_GLOBAL_FUNCS(VK_DISPATCH_ENTRY)
+   VK_INSTANCE_FUNCS(VK_DISPATCH_ENTRY)
+   VK_DEVICE_FUNCS(VK_DISPATCH_ENTRY)
+   VK_SYNC2_FUNCS(VK_DISPATCH_ENTRY)
+#undef VK_DISPATCH_ENTRY
+};
+
+/* Parameters found by --tune for one class of image sizes. A tile
+ * dimension of 0 spans the whole image, so a tile_width of 0 makes bands.
+ * padded aligns the staging rows to the device's optimal copy alignments
+ * and general keeps the images in VK_IMAGE_LAYOUT_GENERAL.
+ */
+struct tuning {
+   VkImageTiling tiling;
+   uint32_t tile_width, tile_height;
+   bool padded, general;
+   unsigned depth;
+};
+
+struct data {
+   struct vk_dispatch vk;
+
+   VkInstance instance;
+   VkPhysicalDevice physical_device;
+   VkDevice device;
+   uint32_t queue_family;
+
+   /* Every queue of the family, the slots take turns, see slot_init(). */
+   VkQueue *queues;
+   uint32_t n_queues, next_queue;
+
+   VkCommandPool cmd_pool;
+
+   /* With --verify, where the checksums run: another family with compute
+    * if there's one, with queues and a pool of its own. Otherwise
+    * queue_family, sharing queues and cmd_pool, and n_compute_queues is 0.
+    */
+   uint32_t compute_family;
+   VkQueue *compute_queues;
+   uint32_t n_compute_queues, next_compute_queue;
+   VkCommandPool compute_pool;
+
+   /* Only queried when caps has no answer, see find_image_memory(). */
+   VkPhysicalDeviceMemoryProperties memory_properties;
+   bool have_memory_properties;
+
+   VkImageTiling tiling;
+
+   /* Whether the device has VK_KHR_synchronization2 and
+    * VK_KHR_copy_commands2, otherwise the cmd_*() wrappers record the
+    * Vulkan 1.0 commands.
+    */
+   bool sync2;
+
+   /* Padded staging rows are a multiple of this, see staging_pitch(). */
+   VkDeviceSize copy_alignment;
+
+   struct caps *caps;
+   struct compiler *compiler;
+   struct checksum *checksum;
+   GHashTable *registry;
+
+   /* Used instead of the tuned parameters while tuning. */
+   const struct tuning *tune;
+
+   /* With --timings, GPU time in the jobs and between them, from the
+    * timestamps of every submission, see slot_wait(). The period is 0 if
+    * the queue has no timestamps.
+    */
+   float timestamp_period;
+   struct {
+      uint64_t busy, idle, last_end;
+      unsigned jobs;
+   } gpu_time;
+
+   /* Time spent in each step of init_vk(), in microseconds. */
+   struct {
+      gint64 loader, instance, enumeration, device;
+   } init_time;
+
+   /* Called when a submission or a wait reports VK_ERROR_DEVICE_LOST.
+    * Without it, the pipeline rebuilds the context and requeues its jobs.
+    */
+   void (*device_lost)(struct data *vc);
+};
+
+#define BLIT_ERROR blit_error_quark()
+
+enum blit_error {
+   BLIT_ERROR_PARSE,
+   BLIT_ERROR_IO,
+};
+
+GQuark blit_error_quark(void);
+
+extern bool image_protected;
+extern bool gpu_verify;
+extern bool delta_uploads;
+extern bool sparse_images;
+
+/* blit.c */
+int find_image_memory(struct data *vc, unsigned allowed, bool host, bool protected);
+void init_vk(struct data *vc);
+void fini_vk(struct data *vc);
+uint32_t staging_pitch(struct data *vc, uint32_t width, bool padded);
+void slot_init(struct data *vc, struct slot *slot);
+bool slot_prepare(struct data *vc, struct slot *slot, struct job *job);
+VkResult slot_submit(struct data *vc, struct slot *slot);
+bool slot_poll(struct data *vc, struct slot *slot);
+VkResult slot_wait(struct data *vc, struct slot *slot);
+bool slot_write_output(struct data *vc, struct slot *slot);
+char *output_name_with_suffix(const char *output, const char *suffix);
+void slot_export_image(struct data *vc, struct slot *slot, const char *id, unsigned refs);
+void slot_fini(struct data *vc, struct slot *slot);
+
+/* caps.c */
+struct caps;
+
+struct caps *caps_open(const VkPhysicalDeviceIDProperties *id,
+                       const VkPhysicalDeviceProperties *properties);
+char *caps_path(struct caps *c, const char *extension);
+bool caps_get(struct caps *c, const char *group, const char *key, int *value);
+void caps_set(struct caps *c, const char *group, const char *key, int value);
+void caps_save(struct caps *c);
+void caps_close(struct caps *c);
+
+/* shaders.c */
+extern const uint32_t checksum_spv[];
+extern const size_t checksum_spv_size;
+
+/* tune.c */
+void tuning_lookup(struct data *vc, uint32_t width, uint32_t height, struct tuning *t);
+unsigned tuned_depth(struct data *vc);
+int tune_run(struct data *vc, const char *input);
+
+/* checksum.c */
+struct checksum;
+
+void checksum_pixbuf(GdkPixbuf *pixbuf, uint32_t lanes[CHECKSUM_LANES]);
+struct checksum *checksum_create(struct data *vc);
+void checksum_destroy(struct data *vc, struct checksum *c);
+bool checksum_slot_init(struct data *vc, struct slot *slot);
+void checksum_slot_release(struct data *vc, struct slot *slot);
+bool checksum_ready(struct data *vc);
+void checksum_record(struct data *vc, struct slot *slot);
+bool checksum_verify(struct slot *slot);
+
+/* compiler.c */
+struct compiler;
+
+struct compiler *compiler_create(struct data *vc, const VkPhysicalDeviceProperties *properties);
+void compiler_queue(struct compiler *c, const VkComputePipelineCreateInfo *info, VkPipeline *pipeline);
+void compiler_wait(struct compiler *c);
+void compiler_destroy(struct compiler *c);
+
+typedef uint8_t v16u8 __attribute__((vector_size(16)));
+
+/* Whether len bytes of a differ from b, or from 0 with a NULL b, compared
+ * 16 at a time (--delta's tiles and --sparse's blocks).
+ */
+static inline bool
+bytes_differ(const guint8 *a, const guint8 *b, size_t len)
+{
+   v16u8 diff = { 0, };
+   size_t i = 0;
+
+   for (; i + sizeof(v16u8) <= len; i += sizeof(v16u8)) {
+      v16u8 va, vb = { 0, };
+
+      memcpy(&va, a + i, sizeof(va));
+      if (b)
+         memcpy(&vb, b + i, sizeof(vb));
+      diff |= va ^ vb;
+   }
+
+   uint64_t lanes[2];
+   memcpy(lanes, &diff, sizeof(lanes));
+   if (lanes[0] | lanes[1])
+      return true;
+
+   for (; i < len; i++) {
+      if (a[i] != (b ? b[i] : 0))
+         return true;
+   }
+
+   return false;
+}
+
+/* delta.c */
+float delta_upload(struct slot *slot, GdkPixbuf *pixbuf);
+void delta_release(struct slot *slot);
+
+/* registry.c */
+bool chain_input(const char *input, char **id, uint32_t *width, uint32_t *height);
+void registry_add(struct data *vc, const char *id, const char *input, VkImage image, VkDeviceMemory mem,
+                  VkQueue queue, uint32_t width, uint32_t height, unsigned refs);
+void registry_release(struct data *vc, const char *id);
+struct gpu_image *registry_lookup(struct data *vc, const char *id, bool *failed);
+void registry_unref(struct data *vc, struct gpu_image *img);
+void registry_clear(struct data *vc);
+GPtrArray *registry_replay(struct data *vc);
+
+/* sparse.c */
+bool sparse_image_init(struct data *vc, struct slot *slot);
+float sparse_bind(struct data *vc, struct slot *slot, GdkPixbuf *pixbuf);
+void sparse_release(struct data *vc, struct slot *slot);
+
+/* dispatch.c */
+void vk_load_global(struct vk_dispatch *vk);
+void vk_load_instance(struct vk_dispatch *vk, VkInstance instance);
+void vk_load_device(struct vk_dispatch *vk, VkDevice device, bool sync2);
+void cmd_pipeline_barrier(struct data *vc, VkCommandBuffer cmd_buffer, const VkDependencyInfo *info);
+void cmd_copy_buffer_to_image(struct data *vc, VkCommandBuffer cmd_buffer,
+                              const VkCopyBufferToImageInfo2 *info);
+void cmd_copy_image_to_buffer(struct data *vc, VkCommandBuffer cmd_buffer,
+                              const VkCopyImageToBufferInfo2 *info);
+void cmd_blit_image(struct data *vc, VkCommandBuffer cmd_buffer, const VkBlitImageInfo2 *info);
+void cmd_write_timestamp(struct data *vc, VkCommandBuffer cmd_buffer, VkPipelineStageFlags2 stage,
+                         VkQueryPool pool, uint32_t query);
+
+/* pipeline.c */
+typedef void (*job_done_cb)(struct job *job, bool success, void *user_data);
+
+struct pipeline;
+
+struct job *job_new(const char *id, const char *input, const char *output);
+void job_free(struct job *job);
+void job_decode(struct job *job);
+bool rect_parse(const char *str, struct rect *rect);
+bool size_parse(const char *str, struct rect *rect);
+void job_add_crop(struct job *job, const struct rect *rect);
+void job_add_scale(struct job *job, const struct rect *rect);
+bool job_add_variant(struct job *job, const char *str);
+
+/* A depth of 0 picks the one found by --tune. */
+struct pipeline *pipeline_create(struct data *vc, unsigned depth,
+                                 job_done_cb done, void *user_data);
+void pipeline_queue(struct pipeline *p, struct job *job);
+unsigned pipeline_capacity(struct pipeline *p);
+void pipeline_finish(struct pipeline *p);
+
+/* manifest.c */
+GPtrArray *manifest_load(const char *path, GError **error);
+bool manifest_link(GPtrArray *jobs, unsigned *n_chained, GError **error);
+
+/* journal.c */
+struct journal;
+
+struct journal *journal_open(const char *path, bool sync_thread, GError **error);
+bool journal_contains(struct journal *j, const char *id);
+void journal_append(struct journal *j, const char *id, const char *hash);
+void journal_close(struct journal *j);
+
+/* net.c */
+
+/* Milliseconds a node may take to accept a connection or answer HELLO. */
+#define NET_TIMEOUT 5000
+
+typedef void (*net_line_cb)(char **words, void *user_data);
+
+int net_listen(const char *address, GError **error);
+int net_connect(const char *address, GError **error);
+bool net_send(int fd, const char *format, ...) G_GNUC_PRINTF(2, 3);
+bool net_receive(int fd, GString *buffer, net_line_cb cb, void *user_data);
+
+/* daemon.c */
+int daemon_run(struct data *vc, const char *address, unsigned depth);
+
+/* coordinator.c */
+int coordinator_run(const char *addresses, GPtrArray *jobs, struct journal *journal);
+
+/* prefork.c */
+int prefork_run(GPtrArray *jobs, struct journal *journal, unsigned n_workers, unsigned depth);
+
+/* watch.c */
+int watch_run(struct pipeline *p, const char *input_dir, const char *output_dir);
+
+#endif /* BLIT_H */
@@ -0,0 +1,154 @@
+/*
+ * Copyright © 2021 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Decisions derived from the device properties (queue family, tiling,
+ * memory types, tuned parameters) are kept in a key file under the user's
+ * cache directory so that later runs skip the probing. The file is named
+ * after the device UUID and thrown away when the driver UUID or the
+ * pipeline cache UUID no longer match, i.e. after a driver update.
+ */
+
+#include "blit.h"
+
+#define CAPS_VERSION 1
+
+struct caps {
+   GKeyFile *file;
+   char *base, *path;
+   bool dirty;
+};
+
+static char *
+uuid_string(const uint8_t uuid[VK_UUID_SIZE])
+{
+   GString *str = g_string_new(NULL);
+
+   for (unsigned i = 0; i < VK_UUID_SIZE; i++)
+      g_string_append_printf(str, "%02x", uuid[i]);
+
+   return g_string_free(str, FALSE);
+}
+
+static bool
+key_equals(GKeyFile *file, const char *key, const char *value)
+{
+   char *str = g_key_file_get_string(file, "cache", key, NULL);
+   bool ret = str && strcmp(str, value) == 0;
+
+   g_free(str);
+
+   return ret;
+}
+
+struct caps *
+caps_open(const VkPhysicalDeviceIDProperties *id, const VkPhysicalDeviceProperties *properties)
+{
+   struct caps *c = g_new0(struct caps, 1);
+   char *device = uuid_string(id->deviceUUID);
+   char *driver = uuid_string(id->driverUUID);
+   char *pipeline_cache = uuid_string(properties->pipelineCacheUUID);
+
+   c->base = g_build_filename(g_get_user_cache_dir(), "blit-protected", device, NULL);
+   c->path = caps_path(c, "ini");
+   c->file = g_key_file_new();
+
+   if (!g_key_file_load_from_file(c->file, c->path, G_KEY_FILE_NONE, NULL) ||
+       g_key_file_get_integer(c->file, "cache", "version", NULL) != CAPS_VERSION ||
+       !key_equals(c->file, "driver-uuid", driver) ||
+       !key_equals(c->file, "pipeline-cache-uuid", pipeline_cache)) {
+      g_key_file_free(c->file);
+      c->file = g_key_file_new();
+      g_key_file_set_integer(c->file, "cache", "version", CAPS_VERSION);
+      g_key_file_set_string(c->file, "cache", "driver-uuid", driver);
+      g_key_file_set_string(c->file, "cache", "pipeline-cache-uuid", pipeline_cache);
+      c->dirty = true;
+   }
+
+   g_free(pipeline_cache);
+   g_free(driver);
+   g_free(device);
+
+   return c;
+}
+
+/* Other files kept for the device, next to the caps. */
+char *
+caps_path(struct caps *c, const char *extension)
+{
+   return g_strconcat(c->base, ".", extension, NULL);
+}
+
+bool
+caps_get(struct caps *c, const char *group, const char *key, int *value)
+{
+   GError *error = NULL;
+   int v = g_key_file_get_integer(c->file, group, key, &error);
+
+   if (error) {
+      g_error_free(error);
+      return false;
+   }
+
+   *value = v;
+
+   return true;
+}
+
+void
+caps_set(struct caps *c, const char *group, const char *key, int value)
+{
+   g_key_file_set_integer(c->file, group, key, value);
+   c->dirty = true;
+}
+
+/* The cache is only an optimization, failing to write it is not an error. */
+void
+caps_save(struct caps *c)
+{
+   GError *error = NULL;
+
+   if (!c->dirty)
+      return;
+
+   char *dir = g_path_get_dirname(c->path);
+   g_mkdir_with_parents(dir, 0700);
+   g_free(dir);
+
+   if (g_key_file_save_to_file(c->file, c->path, &error)) {
+      c->dirty = false;
+   } else {
+      g_info("Unable to write %s: %s\n", c->path, error->message);
+      g_error_free(error);
+   }
+}
+
+void
+caps_close(struct caps *c)
+{
+   caps_save(c);
+   g_key_file_free(c->file);
+   g_free(c->path);
+   g_free(c->base);
+   g_free(c);
+}
@@ -0,0 +1,446 @@
+/*
+ * Copyright © 2021 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * --verify hashes dst_image on the GPU with shaders/checksum.comp instead
+ * of reading it back, and compares the 32 bytes it produces with the same
+ * hash of the decoded input, computed on the CPU by the readahead threads.
+ * Storage images can't be protected, so this only runs unprotected.
+ */
+
+#include "blit.h"
+
+/* Workgroups of 16x16 invocations, each reducing a 64x64 tile. */
+#define CHECKSUM_GROUP_SIZE 16
+#define CHECKSUM_TILE_SIZE 64
+
+struct checksum {
+   VkShaderModule module;
+   VkDescriptorSetLayout set_layout;
+   VkPipelineLayout layout;
+   VkPipeline pipeline;
+
+   /* Referenced by the compiler until compiler_wait() returns. */
+   uint32_t spec[4];
+   VkSpecializationMapEntry spec_entries[4];
+   VkSpecializationInfo spec_info;
+   VkComputePipelineCreateInfo info;
+   bool ready;
+};
+
+static const uint32_t seeds[4] = { 0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344 };
+
+static inline uint32_t
+fmix32(uint32_t h)
+{
+   h ^= h >> 16;
+   h *= 0x85ebca6b;
+   h ^= h >> 13;
+   h *= 0xc2b2ae35;
+   h ^= h >> 16;
+   return h;
+}
+
+void
+checksum_pixbuf(GdkPixbuf *pixbuf, uint32_t lanes[CHECKSUM_LANES])
+{
+   const guint8 *pixels = gdk_pixbuf_read_pixels(pixbuf);
+   uint32_t width = gdk_pixbuf_get_width(pixbuf);
+   uint32_t height = gdk_pixbuf_get_height(pixbuf);
+   uint32_t row_stride = gdk_pixbuf_get_rowstride(pixbuf);
+
+   memset(lanes, 0, CHECKSUM_LANES * sizeof(uint32_t));
+
+   for (uint32_t y = 0; y < height; y++) {
+      const guint8 *row = pixels + (gsize) y * row_stride;
+
+      for (uint32_t x = 0; x < width; x++) {
+         const guint8 *p = row + x * 4;
+         uint32_t v = (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24) ^
+                      ((y * width + x) * 0x9e3779b9);
+
+         for (unsigned i = 0; i < 4; i++) {
+            lanes[i] += fmix32(v + seeds[i]);
+            lanes[4 + i] ^= fmix32(v ^ seeds[i]);
+         }
+      }
+   }
+}
+
+/* The pipeline is compiled in the background, see checksum_record(). */
+struct checksum *
+checksum_create(struct data *vc)
+{
+   struct checksum *c = g_new0(struct checksum, 1);
+
+   vc->vk.CreateShaderModule(vc->device,
+                             &(VkShaderModuleCreateInfo) {
+                                .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+                                .codeSize = checksum_spv_size,
+                                .pCode = checksum_spv,
+                             },
+                             NULL,
+                             &c->module);
+
+   vc->vk.CreateDescriptorSetLayout(vc->device,
+                                    &(VkDescriptorSetLayoutCreateInfo) {
+                                       .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+                                       .bindingCount = 2,
+                                       .pBindings = (VkDescriptorSetLayoutBinding []) {
+                                          {
+                                             .binding = 0,
+                                             .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                                             .descriptorCount = 1,
+                                             .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                                          },
+                                          {
+                                             .binding = 1,
+                                             .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                             .descriptorCount = 1,
+                                             .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                                          },
+                                       },
+                                    },
+                                    NULL,
+                                    &c->set_layout);
+
+   vc->vk.CreatePipelineLayout(vc->device,
+                               &(VkPipelineLayoutCreateInfo) {
+                                  .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+                                  .setLayoutCount = 1,
+                                  .pSetLayouts = &c->set_layout,
+                               },
+                               NULL,
+                               &c->layout);
+
+   c->spec[0] = CHECKSUM_GROUP_SIZE;
+   c->spec[1] = CHECKSUM_GROUP_SIZE;
+   c->spec[2] = CHECKSUM_TILE_SIZE;
+   c->spec[3] = CHECKSUM_TILE_SIZE;
+   for (unsigned i = 0; i < G_N_ELEMENTS(c->spec); i++) {
+      c->spec_entries[i] = (VkSpecializationMapEntry) {
+         .constantID = i,
+         .offset = i * sizeof(uint32_t),
+         .size = sizeof(uint32_t),
+      };
+   }
+   c->spec_info = (VkSpecializationInfo) {
+      .mapEntryCount = G_N_ELEMENTS(c->spec_entries),
+      .pMapEntries = c->spec_entries,
+      .dataSize = sizeof(c->spec),
+      .pData = c->spec,
+   };
+
+   c->info = (VkComputePipelineCreateInfo) {
+      .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+      .stage = {
+         .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+         .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+         .module = c->module,
+         .pName = "main",
+         .pSpecializationInfo = &c->spec_info,
+      },
+      .layout = c->layout,
+   };
+   compiler_queue(vc->compiler, &c->info, &c->pipeline);
+
+   return c;
+}
+
+void
+checksum_destroy(struct data *vc, struct checksum *c)
+{
+   compiler_wait(vc->compiler);
+
+   vc->vk.DestroyPipeline(vc->device, c->pipeline, NULL);
+   vc->vk.DestroyPipelineLayout(vc->device, c->layout, NULL);
+   vc->vk.DestroyDescriptorSetLayout(vc->device, c->set_layout, NULL);
+   vc->vk.DestroyShaderModule(vc->device, c->module, NULL);
+   g_free(c);
+}
+
+/* Per slot resources, created along with dst_image. */
+bool
+checksum_slot_init(struct data *vc, struct slot *slot)
+{
+   VkMemoryRequirements requirements;
+   VkResult res;
+
+   vc->vk.CreateImageView(vc->device,
+                          &(VkImageViewCreateInfo) {
+                             .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+                             .image = slot->dst_image,
+                             .viewType = VK_IMAGE_VIEW_TYPE_2D,
+                             .format = VK_FORMAT_R8G8B8A8_UNORM,
+                             .subresourceRange = {
+                                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                                .baseMipLevel = 0,
+                                .levelCount = 1,
+                                .baseArrayLayer = 0,
+                                .layerCount = 1,
+                             },
+                          },
+                          NULL,
+                          &slot->view);
+
+   vc->vk.CreateBuffer(vc->device,
+                       &(VkBufferCreateInfo) {
+                          .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+                          .size = CHECKSUM_LANES * sizeof(uint32_t),
+                          .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                          .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+                       },
+                       NULL,
+                       &slot->hash_buffer);
+
+   vc->vk.GetBufferMemoryRequirements(vc->device, slot->hash_buffer, &requirements);
+
+   res = vc->vk.AllocateMemory(vc->device,
+                               &(VkMemoryAllocateInfo) {
+                                  .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                                  .allocationSize = requirements.size,
+                                  .memoryTypeIndex = find_image_memory(vc, requirements.memoryTypeBits, true /* host */, false /* protected */),
+                               },
+                               NULL,
+                               &slot->hash_mem);
+   if (res != VK_SUCCESS)
+      return false;
+
+   vc->vk.BindBufferMemory(vc->device, slot->hash_buffer, slot->hash_mem, 0);
+   vc->vk.MapMemory(vc->device, slot->hash_mem, 0, VK_WHOLE_SIZE, 0, (void **) &slot->hash_map);
+
+   vc->vk.CreateDescriptorPool(vc->device,
+                               &(VkDescriptorPoolCreateInfo) {
+                                  .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+                                  .maxSets = 1,
+                                  .poolSizeCount = 2,
+                                  .pPoolSizes = (VkDescriptorPoolSize []) {
+                                     { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1 },
+                                     { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 },
+                                  },
+                               },
+                               NULL,
+                               &slot->desc_pool);
+
+   vc->vk.AllocateDescriptorSets(vc->device,
+                                 &(VkDescriptorSetAllocateInfo) {
+                                    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+                                    .descriptorPool = slot->desc_pool,
+                                    .descriptorSetCount = 1,
+                                    .pSetLayouts = &vc->checksum->set_layout,
+                                 },
+                                 &slot->desc_set);
+
+   vc->vk.UpdateDescriptorSets(vc->device, 2,
+                               (VkWriteDescriptorSet []) {
+                                  {
+                                     .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                                     .dstSet = slot->desc_set,
+                                     .dstBinding = 0,
+                                     .descriptorCount = 1,
+                                     .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                                     .pImageInfo = &(VkDescriptorImageInfo) {
+                                        .imageView = slot->view,
+                                        .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+                                     },
+                                  },
+                                  {
+                                     .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                                     .dstSet = slot->desc_set,
+                                     .dstBinding = 1,
+                                     .descriptorCount = 1,
+                                     .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                     .pBufferInfo = &(VkDescriptorBufferInfo) {
+                                        .buffer = slot->hash_buffer,
+                                        .offset = 0,
+                                        .range = VK_WHOLE_SIZE,
+                                     },
+                                  },
+                               },
+                               0, NULL);
+
+   return true;
+}
+
+void
+checksum_slot_release(struct data *vc, struct slot *slot)
+{
+   if (slot->hash_map)
+      vc->vk.UnmapMemory(vc->device, slot->hash_mem);
+
+   vc->vk.DestroyDescriptorPool(vc->device, slot->desc_pool, NULL);
+   vc->vk.DestroyBuffer(vc->device, slot->hash_buffer, NULL);
+   vc->vk.FreeMemory(vc->device, slot->hash_mem, NULL);
+   vc->vk.DestroyImageView(vc->device, slot->view, NULL);
+
+   slot->hash_map = NULL;
+   slot->desc_pool = VK_NULL_HANDLE;
+   slot->desc_set = VK_NULL_HANDLE;
+   slot->hash_buffer = VK_NULL_HANDLE;
+   slot->hash_mem = VK_NULL_HANDLE;
+   slot->view = VK_NULL_HANDLE;
+}
+
+/* Waits for the pipeline the first time, false if it failed to compile. */
+bool
+checksum_ready(struct data *vc)
+{
+   struct checksum *c = vc->checksum;
+
+   if (!c->ready) {
+      compiler_wait(vc->compiler);
+      c->ready = true;
+   }
+
+   return c->pipeline != VK_NULL_HANDLE;
+}
+
+/* Recorded in place of the readback, for the compute queue, where it
+ * waits for the upload on slot->uploaded. The image is acquired from the
+ * copies' family, and given back to it for the next upload with --delta.
+ * Only once checksum_ready() returned true.
+ */
+void
+checksum_record(struct data *vc, struct slot *slot)
+{
+   struct checksum *c = vc->checksum;
+   VkCommandBuffer cmd_buffer = slot->compute_cmd_buffer;
+
+   vc->vk.BeginCommandBuffer(cmd_buffer,
+                             &(VkCommandBufferBeginInfo) {
+                                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                                .flags = 0
+                             });
+
+   vc->vk.CmdFillBuffer(cmd_buffer, slot->hash_buffer, 0, VK_WHOLE_SIZE, 0);
+
+   /* Chains aren't verified, the upload is always copies, which the
+    * semaphore wait makes available. Across families, the barrier is the
+    * acquire matching the release after the upload.
+    */
+   bool acquire = vc->compute_family != vc->queue_family;
+   cmd_pipeline_barrier(vc, cmd_buffer,
+                        &(const VkDependencyInfo) {
+                           .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                           .bufferMemoryBarrierCount = 1,
+                           .pBufferMemoryBarriers = &(const VkBufferMemoryBarrier2) {
+                              .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+                              .srcStageMask = VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT,
+                              .srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                              .dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                              .dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_READ_BIT |
+                                               VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                              .buffer = slot->hash_buffer,
+                              .offset = 0,
+                              .size = VK_WHOLE_SIZE,
+                           },
+                           .imageMemoryBarrierCount = 1,
+                           .pImageMemoryBarriers = &(const VkImageMemoryBarrier2) {
+                              .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                              .srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                              .srcAccessMask = VK_ACCESS_2_NONE,
+                              .dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                              .dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_READ_BIT,
+                              .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                              .newLayout = VK_IMAGE_LAYOUT_GENERAL,
+                              .srcQueueFamilyIndex = vc->queue_family,
+                              .dstQueueFamilyIndex = vc->compute_family,
+                              .image = slot->dst_image,
+                              .subresourceRange = {
+                                 .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                                 .baseMipLevel = 0,
+                                 .levelCount = 1,
+                                 .baseArrayLayer = 0,
+                                 .layerCount = 1,
+                              },
+                           },
+                        });
+
+   vc->vk.CmdBindPipeline(cmd_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, c->pipeline);
+   vc->vk.CmdBindDescriptorSets(cmd_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, c->layout,
+                                0, 1, &slot->desc_set, 0, NULL);
+   vc->vk.CmdDispatch(cmd_buffer,
+                      (slot->width + CHECKSUM_TILE_SIZE - 1) / CHECKSUM_TILE_SIZE,
+                      (slot->height + CHECKSUM_TILE_SIZE - 1) / CHECKSUM_TILE_SIZE,
+                      1);
+
+   cmd_pipeline_barrier(vc, cmd_buffer,
+                        &(const VkDependencyInfo) {
+                           .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                           .bufferMemoryBarrierCount = 1,
+                           .pBufferMemoryBarriers = &(const VkBufferMemoryBarrier2) {
+                              .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+                              .srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                              .srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                              .dstStageMask = VK_PIPELINE_STAGE_2_HOST_BIT,
+                              .dstAccessMask = VK_ACCESS_2_HOST_READ_BIT,
+                              .buffer = slot->hash_buffer,
+                              .offset = 0,
+                              .size = VK_WHOLE_SIZE,
+                           },
+                           .imageMemoryBarrierCount = acquire && delta_uploads ? 1 : 0,
+                           .pImageMemoryBarriers = &(const VkImageMemoryBarrier2) {
+                              .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                              .srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                              .srcAccessMask = VK_ACCESS_2_NONE,
+                              .dstStageMask = VK_PIPELINE_STAGE_2_NONE,
+                              .dstAccessMask = VK_ACCESS_2_NONE,
+                              .oldLayout = VK_IMAGE_LAYOUT_GENERAL,
+                              .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                              .srcQueueFamilyIndex = vc->compute_family,
+                              .dstQueueFamilyIndex = vc->queue_family,
+                              .image = slot->dst_image,
+                              .subresourceRange = {
+                                 .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                                 .baseMipLevel = 0,
+                                 .levelCount = 1,
+                                 .baseArrayLayer = 0,
+                                 .layerCount = 1,
+                              },
+                           },
+                        });
+
+   vc->vk.EndCommandBuffer(cmd_buffer);
+}
+
+/* Stands in for slot_write_output(), nothing is written. */
+bool
+checksum_verify(struct slot *slot)
+{
+   struct job *job = slot->job;
+   GString *hash = g_string_new(NULL);
+
+   for (unsigned i = 0; i < CHECKSUM_LANES; i++)
+      g_string_append_printf(hash, "%08x", slot->hash_map[i]);
+
+   bool ret = memcmp(slot->hash_map, job->source_hash, sizeof(job->source_hash)) == 0;
+   if (!ret)
+      g_warning("%s: the GPU checksum %s doesn't match the input", job->input, hash->str);
+
+   if (ret && job->checksum)
+      job->output_hash = g_string_free(hash, FALSE);
+   else
+      g_string_free(hash, TRUE);
+
+   return ret;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright © 2021 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Compute pipelines are created from a VkPipelineCache saved next to the
+ * device caps, on a pool of threads started with the device. Stages queue
+ * their pipelines from init_vk() and only wait for them when they record
+ * their first dispatch, so compiling doesn't add to the first job's
+ * latency unless the cache is cold and the job is already there.
+ */
+
+#include "blit.h"
+
+struct compiler {
+   struct data *vc;
+   char *path;
+
+   VkPipelineCache cache;
+   bool dirty;
+
+   GThreadPool *pool;
+   GMutex lock;
+   GCond cond;
+   unsigned pending;
+};
+
+struct compile {
+   const VkComputePipelineCreateInfo *info;
+   VkPipeline *pipeline;
+};
+
+/* The driver validates the data too, but doesn't have to accept or
+ * reject it cheaply.
+ */
+static bool
+cache_data_valid(const void *data, size_t size, const VkPhysicalDeviceProperties *properties)
+{
+   VkPipelineCacheHeaderVersionOne header;
+
+   if (size < sizeof(header))
+      return false;
+   memcpy(&header, data, sizeof(header));
+
+   return header.headerSize >= sizeof(header) && header.headerSize <= size &&
+          header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+          header.vendorID == properties->vendorID &&
+          header.deviceID == properties->deviceID &&
+          memcmp(header.pipelineCacheUUID, properties->pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+static void
+compile_pipeline(gpointer data, gpointer user_data)
+{
+   struct compile *compile = data;
+   struct compiler *c = user_data;
+   struct data *vc = c->vc;
+
+   VkResult res = vc->vk.CreateComputePipelines(vc->device, c->cache, 1, compile->info,
+                                                NULL, compile->pipeline);
+   if (res != VK_SUCCESS) {
+      g_warning("Unable to create a compute pipeline: %d", res);
+      *compile->pipeline = VK_NULL_HANDLE;
+   }
+
+   g_mutex_lock(&c->lock);
+   c->dirty = true;
+   c->pending--;
+   g_cond_broadcast(&c->cond);
+   g_mutex_unlock(&c->lock);
+
+   g_free(compile);
+}
+
+struct compiler *
+compiler_create(struct data *vc, const VkPhysicalDeviceProperties *properties)
+{
+   struct compiler *c = g_new0(struct compiler, 1);
+   gchar *data = NULL;
+   gsize size = 0;
+
+   c->vc = vc;
+   c->path = caps_path(vc->caps, "pipelines");
+
+   if (g_file_get_contents(c->path, &data, &size, NULL) &&
+       !cache_data_valid(data, size, properties)) {
+      g_info("Discarding %s, it was written by another device or driver\n", c->path);
+      g_clear_pointer(&data, g_free);
+      size = 0;
+   }
+
+   VkResult res = vc->vk.CreatePipelineCache(vc->device,
+                                             &(VkPipelineCacheCreateInfo) {
+                                                .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+                                                .initialDataSize = size,
+                                                .pInitialData = data,
+                                             },
+                                             NULL,
+                                             &c->cache);
+   if (res != VK_SUCCESS)
+      c->cache = VK_NULL_HANDLE;
+
+   g_free(data);
+
+   g_mutex_init(&c->lock);
+   g_cond_init(&c->cond);
+   c->pool = g_thread_pool_new(compile_pipeline, c, g_get_num_processors(), FALSE, NULL);
+
+   return c;
+}
+
+/* Creates the pipeline in the background, info must stay valid until
+ * compiler_wait() returns.
+ */
+void
+compiler_queue(struct compiler *c, const VkComputePipelineCreateInfo *info, VkPipeline *pipeline)
+{
+   struct compile *compile = g_new(struct compile, 1);
+
+   compile->info = info;
+   compile->pipeline = pipeline;
+
+   g_mutex_lock(&c->lock);
+   c->pending++;
+   g_mutex_unlock(&c->lock);
+
+   g_thread_pool_push(c->pool, compile, NULL);
+}
+
+void
+compiler_wait(struct compiler *c)
+{
+   g_mutex_lock(&c->lock);
+   while (c->pending > 0)
+      g_cond_wait(&c->cond, &c->lock);
+   g_mutex_unlock(&c->lock);
+}
+
+static void
+save_cache(struct compiler *c)
+{
+   struct data *vc = c->vc;
+   GError *error = NULL;
+   size_t size = 0;
+
+   if (!c->dirty || c->cache == VK_NULL_HANDLE)
+      return;
+
+   if (vc->vk.GetPipelineCacheData(vc->device, c->cache, &size, NULL) != VK_SUCCESS)
+      return;
+
+   void *data = g_malloc(size);
+   if (vc->vk.GetPipelineCacheData(vc->device, c->cache, &size, data) == VK_SUCCESS) {
+      char *dir = g_path_get_dirname(c->path);
+      g_mkdir_with_parents(dir, 0700);
+      g_free(dir);
+
+      if (!g_file_set_contents(c->path, data, size, &error)) {
+         g_info("Unable to write %s: %s\n", c->path, error->message);
+         g_error_free(error);
+      }
+   }
+   g_free(data);
+}
+
+void
+compiler_destroy(struct compiler *c)
+{
+   struct data *vc = c->vc;
+
+   g_thread_pool_free(c->pool, FALSE, TRUE);
+
+   save_cache(c);
+   vc->vk.DestroyPipelineCache(vc->device, c->cache, NULL);
+
+   g_mutex_clear(&c->lock);
+   g_cond_clear(&c->cond);
+   g_free(c->path);
+   g_free(c);
+}
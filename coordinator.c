@@ -0,0 +1,342 @@
+/*
+ * Copyright © 2021 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Spreads a manifest over several daemons (see daemon.c). The jobs are
+ * first sharded in proportion to the capacity each node reports, then
+ * every node is kept at its capacity from its own shard. A node that runs
+ * out steals the back half of the largest remaining shard, so faster nodes
+ * end up doing more of the work. Jobs of a node that goes away are
+ * re-sharded over the others.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "blit.h"
+
+struct node {
+   char *address;
+   int fd;
+   GString *buffer;
+   unsigned capacity;
+
+   /* Jobs sharded to this node and not sent yet. */
+   GQueue queue;
+
+   /* Jobs sent and not completed yet. */
+   GPtrArray *sent;
+};
+
+struct coordinator {
+   struct node *nodes;
+   unsigned n_nodes;
+
+   struct journal *journal;
+   unsigned done, failed, stolen;
+
+   struct node *node;
+};
+
+static bool
+node_alive(const struct node *node)
+{
+   return node->fd >= 0;
+}
+
+/* Least loaded live node, relative to its capacity. */
+static struct node *
+pick_node(struct coordinator *c)
+{
+   struct node *best = NULL;
+
+   for (unsigned i = 0; i < c->n_nodes; i++) {
+      struct node *node = &c->nodes[i];
+
+      if (!node_alive(node))
+         continue;
+
+      if (!best ||
+          (uint64_t) (node->queue.length + node->sent->len) * best->capacity <
+          (uint64_t) (best->queue.length + best->sent->len) * node->capacity)
+         best = node;
+   }
+
+   return best;
+}
+
+static struct job *
+steal(struct coordinator *c, struct node *thief)
+{
+   struct node *victim = NULL;
+
+   for (unsigned i = 0; i < c->n_nodes; i++) {
+      struct node *node = &c->nodes[i];
+
+      if (node != thief && node_alive(node) &&
+          (!victim || node->queue.length > victim->queue.length))
+         victim = node;
+   }
+
+   if (!victim || victim->queue.length == 0)
+      return NULL;
+
+   /* Take the back half, keeping the order. */
+   unsigned n = (victim->queue.length + 1) / 2;
+   for (unsigned i = 0; i < n; i++)
+      g_queue_push_head(&thief->queue, g_queue_pop_tail(&victim->queue));
+   c->stolen += n;
+
+   return g_queue_pop_head(&thief->queue);
+}
+
+static void
+fill(struct coordinator *c, struct node *node)
+{
+   while (node_alive(node) && node->sent->len < node->capacity) {
+      struct job *job = g_queue_pop_head(&node->queue);
+
+      if (!job)
+         job = steal(c, node);
+      if (!job)
+         break;
+
+      GString *variants = g_string_new(NULL);
+      for (unsigned i = 0; i < job->n_crops; i++) {
+         const struct rect *r = &job->crops[i];
+         g_string_append_printf(variants, " %ux%u+%u+%u", r->width, r->height, r->x, r->y);
+      }
+      for (unsigned i = 0; i < job->n_scales; i++) {
+         const struct rect *r = &job->scales[i];
+         g_string_append_printf(variants, " %ux%u", r->width, r->height);
+      }
+
+      g_ptr_array_add(node->sent, job);
+      bool sent = net_send(node->fd, "JOB %s %s %s%s\n", job->id, job->input, job->output, variants->str);
+      g_string_free(variants, TRUE);
+      if (!sent)
+         break;
+   }
+}
+
+static void
+node_lost(struct coordinator *c, struct node *node)
+{
+   g_warning("Lost node %s, re-sharding %u jobs", node->address,
+             node->sent->len + node->queue.length);
+
+   close(node->fd);
+   node->fd = -1;
+
+   GQueue orphans = G_QUEUE_INIT;
+   for (unsigned i = 0; i < node->sent->len; i++)
+      g_queue_push_tail(&orphans, g_ptr_array_index(node->sent, i));
+   g_ptr_array_set_size(node->sent, 0);
+   while (node->queue.length)
+      g_queue_push_tail(&orphans, g_queue_pop_head(&node->queue));
+
+   struct job *job;
+   while ((job = g_queue_pop_head(&orphans))) {
+      struct node *target = pick_node(c);
+
+      if (!target) {
+         c->failed++;
+         job_free(job);
+         continue;
+      }
+      g_queue_push_tail(&target->queue, job);
+   }
+
+   for (unsigned i = 0; i < c->n_nodes; i++)
+      fill(c, &c->nodes[i]);
+}
+
+static struct job *
+take_sent(struct node *node, const char *id)
+{
+   for (unsigned i = 0; i < node->sent->len; i++) {
+      struct job *job = g_ptr_array_index(node->sent, i);
+
+      if (!strcmp(job->id, id))
+         return g_ptr_array_remove_index(node->sent, i);
+   }
+
+   return NULL;
+}
+
+static void
+coordinator_reply(char **words, void *user_data)
+{
+   struct coordinator *c = user_data;
+   struct node *node = c->node;
+   unsigned n = g_strv_length(words);
+
+   if (!strcmp(words[0], "CAPACITY") && n == 2) {
+      node->capacity = MAX(1, atoi(words[1]));
+      return;
+   }
+
+   struct job *job = n >= 2 ? take_sent(node, words[1]) : NULL;
+   if (!job) {
+      g_warning("%s: unexpected reply \"%s\"", node->address, words[0]);
+      return;
+   }
+
+   if (!strcmp(words[0], "DONE")) {
+      c->done++;
+      if (c->journal)
+         journal_append(c->journal, job->id,
+                        n > 2 && strcmp(words[2], "-") ? words[2] : NULL);
+   } else {
+      g_warning("%s: job %s failed", node->address, job->id);
+      c->failed++;
+   }
+   job_free(job);
+}
+
+static bool
+node_connect(struct coordinator *c, struct node *node)
+{
+   GError *error = NULL;
+
+   node->fd = net_connect(node->address, &error);
+   if (node->fd < 0) {
+      g_warning("Unable to reach %s: %s", node->address, error->message);
+      g_error_free(error);
+      return false;
+   }
+
+   /* Capacity discovery. */
+   c->node = node;
+   if (net_send(node->fd, "HELLO\n")) {
+      struct pollfd pfd = { .fd = node->fd, .events = POLLIN };
+
+      while (node->capacity == 0 && poll(&pfd, 1, NET_TIMEOUT) > 0 &&
+             net_receive(node->fd, node->buffer, coordinator_reply, c))
+         ;
+   }
+
+   if (node->capacity == 0) {
+      g_warning("%s did not report its capacity", node->address);
+      close(node->fd);
+      node->fd = -1;
+      return false;
+   }
+
+   g_info("%s: capacity %u\n", node->address, node->capacity);
+
+   return true;
+}
+
+static bool
+pending(struct coordinator *c)
+{
+   for (unsigned i = 0; i < c->n_nodes; i++) {
+      if (node_alive(&c->nodes[i]) &&
+          (c->nodes[i].sent->len || c->nodes[i].queue.length))
+         return true;
+   }
+
+   return false;
+}
+
+int
+coordinator_run(const char *addresses, GPtrArray *jobs, struct journal *journal)
+{
+   gchar **list = g_strsplit(addresses, ",", -1);
+   struct coordinator c = {
+      .n_nodes = g_strv_length(list),
+      .journal = journal,
+   };
+   unsigned alive = 0;
+
+   c.nodes = g_new0(struct node, c.n_nodes);
+   for (unsigned i = 0; i < c.n_nodes; i++) {
+      struct node *node = &c.nodes[i];
+
+      node->address = g_strdup(g_strstrip(list[i]));
+      node->buffer = g_string_new(NULL);
+      node->sent = g_ptr_array_new();
+      g_queue_init(&node->queue);
+
+      if (node_connect(&c, node))
+         alive++;
+   }
+   g_strfreev(list);
+
+   if (alive == 0) {
+      g_warning("No node available");
+      c.failed = jobs->len;
+      for (unsigned i = 0; i < jobs->len; i++)
+         job_free(g_ptr_array_index(jobs, i));
+   } else {
+      for (unsigned i = 0; i < jobs->len; i++)
+         g_queue_push_tail(&pick_node(&c)->queue, g_ptr_array_index(jobs, i));
+   }
+
+   for (unsigned i = 0; i < c.n_nodes; i++)
+      fill(&c, &c.nodes[i]);
+
+   while (pending(&c)) {
+      struct pollfd fds[c.n_nodes];
+
+      for (unsigned i = 0; i < c.n_nodes; i++)
+         fds[i] = (struct pollfd) { .fd = c.nodes[i].fd, .events = POLLIN };
+
+      if (poll(fds, c.n_nodes, -1) < 0) {
+         if (errno == EINTR)
+            continue;
+         g_error("poll: %s", g_strerror(errno));
+      }
+
+      for (unsigned i = 0; i < c.n_nodes; i++) {
+         struct node *node = &c.nodes[i];
+
+         if (!fds[i].revents || !node_alive(node))
+            continue;
+
+         c.node = node;
+         if (net_receive(node->fd, node->buffer, coordinator_reply, &c))
+            fill(&c, node);
+         else
+            node_lost(&c, node);
+      }
+   }
+
+   g_info("%u jobs done, %u failed, %u stolen\n", c.done, c.failed, c.stolen);
+
+   for (unsigned i = 0; i < c.n_nodes; i++) {
+      struct node *node = &c.nodes[i];
+
+      if (node_alive(node))
+         close(node->fd);
+      g_ptr_array_free(node->sent, TRUE);
+      g_string_free(node->buffer, TRUE);
+      g_free(node->address);
+   }
+   g_free(c.nodes);
+
+   return c.failed ? 1 : 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright © 2021 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Serves jobs to coordinators over TCP, on top of the same pipeline as the
+ * other modes. Requests and replies:
+ *
+ *   HELLO                 → CAPACITY <jobs the pipeline takes without blocking>
+ *   JOB <id> <in> <out> [WxH+X+Y...] [WxH...]
+ *                         → DONE <id> <sha256|-> | FAIL <id>  (once completed)
+ *
+ * Input and output paths are resolved on the daemon's host, so they
+ * normally point to storage shared by all the nodes.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "blit.h"
+
+struct conn {
+   int fd;
+   GString *buffer;
+
+   /* Protects fd against the pipeline thread replying to jobs. */
+   GMutex lock;
+
+   /* One for the poll loop and one per job in the pipeline. */
+   gint refcount;
+};
+
+struct daemon {
+   struct pipeline *p;
+   struct conn *conn;
+};
+
+static volatile sig_atomic_t daemon_stop;
+
+static void
+daemon_signal(int sig)
+{
+   daemon_stop = 1;
+}
+
+static struct conn *
+conn_new(int fd)
+{
+   struct conn *conn = g_new0(struct conn, 1);
+
+   conn->fd = fd;
+   conn->buffer = g_string_new(NULL);
+   g_mutex_init(&conn->lock);
+   conn->refcount = 1;
+
+   return conn;
+}
+
+static void
+conn_unref(struct conn *conn)
+{
+   if (!g_atomic_int_dec_and_test(&conn->refcount))
+      return;
+
+   g_string_free(conn->buffer, TRUE);
+   g_mutex_clear(&conn->lock);
+   g_free(conn);
+}
+
+static void
+conn_reply(struct conn *conn, const char *line)
+{
+   g_mutex_lock(&conn->lock);
+   if (conn->fd >= 0)
+      net_send(conn->fd, "%s\n", line);
+   g_mutex_unlock(&conn->lock);
+}
+
+static void
+conn_close(struct conn *conn)
+{
+   g_mutex_lock(&conn->lock);
+   close(conn->fd);
+   conn->fd = -1;
+   g_mutex_unlock(&conn->lock);
+
+   conn_unref(conn);
+}
+
+static void
+daemon_done(struct job *job, bool success, void *user_data)
+{
+   struct conn *conn = job->data;
+   gchar *line = success ?
+      g_strdup_printf("DONE %s %s", job->id,
+                      job->output_hash ? job->output_hash : "-") :
+      g_strdup_printf("FAIL %s", job->id);
+
+   conn_reply(conn, line);
+   g_free(line);
+   conn_unref(conn);
+}
+
+static void
+daemon_request(char **words, void *user_data)
+{
+   struct daemon *d = user_data;
+   struct conn *conn = d->conn;
+
+   if (!strcmp(words[0], "HELLO")) {
+      gchar *line = g_strdup_printf("CAPACITY %u", pipeline_capacity(d->p));
+      conn_reply(conn, line);
+      g_free(line);
+   } else if (!strcmp(words[0], "JOB") && g_strv_length(words) >= 4) {
+      struct job *job = job_new(words[1], words[2], words[3]);
+      /* Chained inputs (see registry.c) only make sense within a manifest. */
+      bool ok = job->input[0] != '@';
+
+      for (unsigned i = 4; ok && words[i]; i++)
+         ok = job_add_variant(job, words[i]);
+
+      if (!ok) {
+         gchar *line = g_strdup_printf("FAIL %s", job->id);
+         conn_reply(conn, line);
+         g_free(line);
+         job_free(job);
+         return;
+      }
+
+      job->checksum = true;
+      job->data = conn;
+      g_atomic_int_inc(&conn->refcount);
+      pipeline_queue(d->p, job);
+   } else {
+      conn_reply(conn, "ERROR unknown request");
+   }
+}
+
+int
+daemon_run(struct data *vc, const char *address, unsigned depth)
+{
+   GError *error = NULL;
+   int listen_fd = net_listen(address, &error);
+
+   if (listen_fd < 0) {
+      g_warning("Unable to listen: %s", error->message);
+      g_error_free(error);
+      return 1;
+   }
+
+   struct sigaction sa = { .sa_handler = daemon_signal };
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGTERM, &sa, NULL);
+
+   struct daemon d = {
+      .p = pipeline_create(vc, depth, daemon_done, NULL),
+   };
+   GPtrArray *conns = g_ptr_array_new();
+
+   while (!daemon_stop) {
+      unsigned n = conns->len;
+      struct pollfd fds[n + 1];
+      struct conn *polled[n];
+
+      fds[0] = (struct pollfd) { .fd = listen_fd, .events = POLLIN };
+      for (unsigned i = 0; i < n; i++) {
+         polled[i] = g_ptr_array_index(conns, i);
+         fds[i + 1] = (struct pollfd) { .fd = polled[i]->fd, .events = POLLIN };
+      }
+
+      if (poll(fds, n + 1, -1) < 0) {
+         if (errno == EINTR)
+            continue;
+         g_warning("poll: %s", g_strerror(errno));
+         break;
+      }
+
+      for (unsigned i = 0; i < n; i++) {
+         if (!fds[i + 1].revents)
+            continue;
+
+         d.conn = polled[i];
+         if (!net_receive(polled[i]->fd, polled[i]->buffer, daemon_request, &d)) {
+            g_ptr_array_remove_fast(conns, polled[i]);
+            conn_close(polled[i]);
+         }
+      }
+
+      if (fds[0].revents & POLLIN) {
+         int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+         if (fd >= 0)
+            g_ptr_array_add(conns, conn_new(fd));
+      }
+   }
+
+   for (unsigned i = 0; i < conns->len; i++)
+      conn_close(g_ptr_array_index(conns, i));
+   g_ptr_array_free(conns, TRUE);
+   close(listen_fd);
+
+   pipeline_finish(d.p);
+
+   return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright © 2021 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * --delta keeps every slot's dst_image resident and only uploads the
+ * 64x64 tiles of a frame that differ from the last frame uploaded through
+ * the same slot. A copy of that frame is kept in system memory, reading it
+ * back from the write-combined staging buffer would be slow.
+ */
+
+#include "blit.h"
+
+#define DELTA_TILE_SIZE 64
+
+/* Uploads the tiles of pixbuf that changed into the staging buffer and
+ * lists them in slot->dirty. All of them change while the image isn't
+ * resident yet. Returns the changed fraction.
+ */
+float
+delta_upload(struct slot *slot, GdkPixbuf *pixbuf)
+{
+   const guint8 *pixels = gdk_pixbuf_read_pixels(pixbuf);
+   uint32_t stride = slot->width * 4;
+   uint32_t tiles_x = (slot->width + DELTA_TILE_SIZE - 1) / DELTA_TILE_SIZE;
+   uint32_t tiles_y = (slot->height + DELTA_TILE_SIZE - 1) / DELTA_TILE_SIZE;
+
+   if (!slot->prev_pixels) {
+      slot->prev_pixels = g_malloc((gsize) stride * slot->height);
+      slot->dirty = g_new(VkBufferImageCopy2, tiles_x * tiles_y);
+      slot->resident = false;
+   }
+   slot->n_dirty = 0;
+
+   for (uint32_t ty = 0; ty < tiles_y; ty++) {
+      for (uint32_t tx = 0; tx < tiles_x; tx++) {
+         uint32_t x = tx * DELTA_TILE_SIZE, y = ty * DELTA_TILE_SIZE;
+         uint32_t width = MIN(DELTA_TILE_SIZE, slot->width - x);
+         uint32_t height = MIN(DELTA_TILE_SIZE, slot->height - y);
+         bool changed = !slot->resident;
+
+         for (uint32_t row = y; !changed && row < y + height; row++) {
+            changed = bytes_differ(pixels + (gsize) row * slot->row_stride + x * 4,
+                                   slot->prev_pixels + (gsize) row * stride + x * 4,
+                                   width * 4);
+         }
+         if (!changed)
+            continue;
+
+         for (uint32_t row = y; row < y + height; row++) {
+            const guint8 *src = pixels + (gsize) row * slot->row_stride + x * 4;
+            gsize offset = (gsize) row * stride + x * 4;
+
+            memcpy((guint8 *) slot->src_map + (gsize) row * slot->pitch + x * 4, src, width * 4);
+            memcpy(slot->prev_pixels + offset, src, width * 4);
+         }
+
+         slot->dirty[slot->n_dirty++] = (VkBufferImageCopy2) {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_IMAGE_COPY_2,
+            .bufferOffset = (VkDeviceSize) y * slot->pitch + x * 4,
+            .bufferRowLength = slot->pitch / 4,
+            .bufferImageHeight = slot->height,
+            .imageSubresource = {
+               .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+               .mipLevel = 0,
+               .baseArrayLayer = 0,
+               .layerCount = 1,
+            },
+            .imageOffset = { x, y, 0, },
+            .imageExtent = { width, height, 1 },
+         };
+      }
+   }
+
+   return (float) slot->n_dirty / (tiles_x * tiles_y);
+}
+
+void
+delta_release(struct slot *slot)
+{
+   g_clear_pointer(&slot->prev_pixels, g_free);
+   g_clear_pointer(&slot->dirty, g_free);
+   slot->n_dirty = 0;
+   slot->resident = false;
+}
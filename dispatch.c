@@ -0,0 +1,253 @@
+/*
+ * Copyright © 2021 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Function pointer tables, loaded the way volk does it: the global and
+ * instance-level entry points through vkGetInstanceProcAddr(), the
+ * device-level ones through vkGetDeviceProcAddr() so that they point
+ * straight into the driver instead of the loader's dispatch trampolines.
+ *
+ * The commands are recorded with synchronization2 and copy_commands2 when
+ * the device has them. Otherwise the cmd_*() wrappers translate to the
+ * Vulkan 1.0 commands, which is all the baseline requires.
+ */
+
+#include "blit.h"
+
+void
+vk_load_global(struct vk_dispatch *vk)
+{
+#define LOAD(name) \
+   vk->name = (PFN_vk##name) vkGetInstanceProcAddr(VK_NULL_HANDLE, "vk" #name); \
+   if (!vk->name) \
+      g_error("Unable to load vk" #name);
+   VK_GLOBAL_FUNCS(LOAD)
+#undef LOAD
+}
+
+void
+vk_load_instance(struct vk_dispatch *vk, VkInstance instance)
+{
+#define LOAD(name) \
+   vk->name = (PFN_vk##name) vkGetInstanceProcAddr(instance, "vk" #name); \
+   if (!vk->name) \
+      g_error("Unable to load vk" #name);
+   VK_INSTANCE_FUNCS(LOAD)
+#undef LOAD
+}
+
+void
+vk_load_device(struct vk_dispatch *vk, VkDevice device, bool sync2)
+{
+#define LOAD(name) \
+   vk->name = (PFN_vk##name) vk->GetDeviceProcAddr(device, "vk" #name); \
+   if (!vk->name) \
+      g_error("Unable to load vk" #name);
+   VK_DEVICE_FUNCS(LOAD)
+   if (sync2) {
+      VK_SYNC2_FUNCS(LOAD)
+   }
+#undef LOAD
+}
+
+/* The synchronization2 stages and accesses the tool uses, in 1.0 terms.
+ * No stage at all is TOP_OF_PIPE as a source and BOTTOM_OF_PIPE as a
+ * destination.
+ */
+static VkPipelineStageFlags
+legacy_stages(VkPipelineStageFlags2 stages, VkPipelineStageFlags none)
+{
+   const VkPipelineStageFlags2 transfer = VK_PIPELINE_STAGE_2_COPY_BIT |
+                                          VK_PIPELINE_STAGE_2_BLIT_BIT |
+                                          VK_PIPELINE_STAGE_2_RESOLVE_BIT |
+                                          VK_PIPELINE_STAGE_2_CLEAR_BIT;
+
+   if (stages & transfer)
+      stages = (stages & ~transfer) | VK_PIPELINE_STAGE_TRANSFER_BIT;
+
+   return stages ? (VkPipelineStageFlags) stages : none;
+}
+
+static VkAccessFlags
+legacy_access(VkAccessFlags2 access)
+{
+   if (access & VK_ACCESS_2_SHADER_STORAGE_READ_BIT)
+      access = (access & ~VK_ACCESS_2_SHADER_STORAGE_READ_BIT) | VK_ACCESS_SHADER_READ_BIT;
+   if (access & VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT)
+      access = (access & ~VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT) | VK_ACCESS_SHADER_WRITE_BIT;
+
+   return (VkAccessFlags) access;
+}
+
+/* vkCmdPipelineBarrier() has one pair of stage masks for all barriers. */
+void
+cmd_pipeline_barrier(struct data *vc, VkCommandBuffer cmd_buffer, const VkDependencyInfo *info)
+{
+   if (vc->sync2) {
+      vc->vk.CmdPipelineBarrier2KHR(cmd_buffer, info);
+      return;
+   }
+
+   VkPipelineStageFlags2 src_stages = 0, dst_stages = 0;
+   VkMemoryBarrier memory[MAX(info->memoryBarrierCount, 1)];
+   VkBufferMemoryBarrier buffers[MAX(info->bufferMemoryBarrierCount, 1)];
+   VkImageMemoryBarrier images[MAX(info->imageMemoryBarrierCount, 1)];
+
+   for (uint32_t i = 0; i < info->memoryBarrierCount; i++) {
+      const VkMemoryBarrier2 *b = &info->pMemoryBarriers[i];
+
+      src_stages |= b->srcStageMask;
+      dst_stages |= b->dstStageMask;
+      memory[i] = (VkMemoryBarrier) {
+         .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+         .srcAccessMask = legacy_access(b->srcAccessMask),
+         .dstAccessMask = legacy_access(b->dstAccessMask),
+      };
+   }
+
+   for (uint32_t i = 0; i < info->bufferMemoryBarrierCount; i++) {
+      const VkBufferMemoryBarrier2 *b = &info->pBufferMemoryBarriers[i];
+
+      src_stages |= b->srcStageMask;
+      dst_stages |= b->dstStageMask;
+      buffers[i] = (VkBufferMemoryBarrier) {
+         .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+         .srcAccessMask = legacy_access(b->srcAccessMask),
+         .dstAccessMask = legacy_access(b->dstAccessMask),
+         .srcQueueFamilyIndex = b->srcQueueFamilyIndex,
+         .dstQueueFamilyIndex = b->dstQueueFamilyIndex,
+         .buffer = b->buffer,
+         .offset = b->offset,
+         .size = b->size,
+      };
+   }
+
+   for (uint32_t i = 0; i < info->imageMemoryBarrierCount; i++) {
+      const VkImageMemoryBarrier2 *b = &info->pImageMemoryBarriers[i];
+
+      src_stages |= b->srcStageMask;
+      dst_stages |= b->dstStageMask;
+      images[i] = (VkImageMemoryBarrier) {
+         .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+         .srcAccessMask = legacy_access(b->srcAccessMask),
+         .dstAccessMask = legacy_access(b->dstAccessMask),
+         .oldLayout = b->oldLayout,
+         .newLayout = b->newLayout,
+         .srcQueueFamilyIndex = b->srcQueueFamilyIndex,
+         .dstQueueFamilyIndex = b->dstQueueFamilyIndex,
+         .image = b->image,
+         .subresourceRange = b->subresourceRange,
+      };
+   }
+
+   vc->vk.CmdPipelineBarrier(cmd_buffer,
+                             legacy_stages(src_stages, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT),
+                             legacy_stages(dst_stages, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT),
+                             info->dependencyFlags,
+                             info->memoryBarrierCount, memory,
+                             info->bufferMemoryBarrierCount, buffers,
+                             info->imageMemoryBarrierCount, images);
+}
+
+static VkBufferImageCopy
+legacy_buffer_image_copy(const VkBufferImageCopy2 *r)
+{
+   return (VkBufferImageCopy) {
+      .bufferOffset = r->bufferOffset,
+      .bufferRowLength = r->bufferRowLength,
+      .bufferImageHeight = r->bufferImageHeight,
+      .imageSubresource = r->imageSubresource,
+      .imageOffset = r->imageOffset,
+      .imageExtent = r->imageExtent,
+   };
+}
+
+void
+cmd_copy_buffer_to_image(struct data *vc, VkCommandBuffer cmd_buffer,
+                         const VkCopyBufferToImageInfo2 *info)
+{
+   if (vc->sync2) {
+      vc->vk.CmdCopyBufferToImage2KHR(cmd_buffer, info);
+      return;
+   }
+
+   VkBufferImageCopy regions[MAX(info->regionCount, 1)];
+   for (uint32_t i = 0; i < info->regionCount; i++)
+      regions[i] = legacy_buffer_image_copy(&info->pRegions[i]);
+
+   vc->vk.CmdCopyBufferToImage(cmd_buffer, info->srcBuffer, info->dstImage, info->dstImageLayout,
+                               info->regionCount, regions);
+}
+
+void
+cmd_copy_image_to_buffer(struct data *vc, VkCommandBuffer cmd_buffer,
+                         const VkCopyImageToBufferInfo2 *info)
+{
+   if (vc->sync2) {
+      vc->vk.CmdCopyImageToBuffer2KHR(cmd_buffer, info);
+      return;
+   }
+
+   VkBufferImageCopy regions[MAX(info->regionCount, 1)];
+   for (uint32_t i = 0; i < info->regionCount; i++)
+      regions[i] = legacy_buffer_image_copy(&info->pRegions[i]);
+
+   vc->vk.CmdCopyImageToBuffer(cmd_buffer, info->srcImage, info->srcImageLayout, info->dstBuffer,
+                               info->regionCount, regions);
+}
+
+void
+cmd_blit_image(struct data *vc, VkCommandBuffer cmd_buffer, const VkBlitImageInfo2 *info)
+{
+   if (vc->sync2) {
+      vc->vk.CmdBlitImage2KHR(cmd_buffer, info);
+      return;
+   }
+
+   VkImageBlit regions[MAX(info->regionCount, 1)];
+   for (uint32_t i = 0; i < info->regionCount; i++) {
+      const VkImageBlit2 *r = &info->pRegions[i];
+
+      regions[i] = (VkImageBlit) {
+         .srcSubresource = r->srcSubresource,
+         .srcOffsets = { r->srcOffsets[0], r->srcOffsets[1] },
+         .dstSubresource = r->dstSubresource,
+         .dstOffsets = { r->dstOffsets[0], r->dstOffsets[1] },
+      };
+   }
+
+   vc->vk.CmdBlitImage(cmd_buffer, info->srcImage, info->srcImageLayout,
+                       info->dstImage, info->dstImageLayout,
+                       info->regionCount, regions, info->filter);
+}
+
+void
+cmd_write_timestamp(struct data *vc, VkCommandBuffer cmd_buffer, VkPipelineStageFlags2 stage,
+                    VkQueryPool pool, uint32_t query)
+{
+   if (vc->sync2)
+      vc->vk.CmdWriteTimestamp2KHR(cmd_buffer, stage, pool, query);
+   else
+      vc->vk.CmdWriteTimestamp(cmd_buffer, legacy_stages(stage, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT),
+                               pool, query);
+}
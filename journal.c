@@ -0,0 +1,209 @@
+/*
+ * Copyright © 2021 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Append-only record of the jobs of a batch that completed, one
+ * "id sha256" line each. Lines are written as jobs complete, but only
+ * fdatasync()ed by a background thread, every JOURNAL_SYNC_ENTRIES entries
+ * or JOURNAL_SYNC_USEC, so the submission thread never waits on the disk.
+ * A crash loses at most the unsynced tail, which simply gets redone.
+ *
+ * Processes that fork after opening the journal (--workers) must stay
+ * single-threaded: there journal_append() syncs inline instead.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "blit.h"
+
+#define JOURNAL_SYNC_ENTRIES 64
+#define JOURNAL_SYNC_USEC (1 * G_USEC_PER_SEC)
+
+struct journal {
+   int fd;
+
+   /* id → hash of the jobs completed by previous runs. */
+   GHashTable *done;
+
+   GMutex lock;
+   GCond cond;
+   unsigned unsynced;
+   gint64 last_sync;
+   bool closing;
+
+   /* NULL when journal_append() syncs inline. */
+   GThread *thread;
+};
+
+static void
+journal_load(struct journal *j, const char *contents, gsize length)
+{
+   const char *end = contents + length;
+
+   for (const char *line = contents; line < end; ) {
+      const char *eol = memchr(line, '\n', end - line);
+
+      /* A torn last line is from a crash in the middle of a write. */
+      if (!eol)
+         break;
+
+      gchar *entry = g_strndup(line, eol - line);
+      gchar *space = strchr(entry, ' ');
+      if (space && space != entry) {
+         *space = '\0';
+         g_hash_table_replace(j->done, g_strdup(entry), g_strdup(space + 1));
+      }
+      g_free(entry);
+
+      line = eol + 1;
+   }
+}
+
+static gpointer
+journal_thread(gpointer data)
+{
+   struct journal *j = data;
+
+   g_mutex_lock(&j->lock);
+   while (!j->closing) {
+      gint64 deadline = g_get_monotonic_time() + JOURNAL_SYNC_USEC;
+
+      while (!j->closing && j->unsynced < JOURNAL_SYNC_ENTRIES) {
+         if (!g_cond_wait_until(&j->cond, &j->lock, deadline))
+            break;
+      }
+
+      if (j->unsynced == 0)
+         continue;
+
+      j->unsynced = 0;
+      g_mutex_unlock(&j->lock);
+      fdatasync(j->fd);
+      g_mutex_lock(&j->lock);
+   }
+   g_mutex_unlock(&j->lock);
+
+   return NULL;
+}
+
+struct journal *
+journal_open(const char *path, bool sync_thread, GError **error)
+{
+   struct journal *j = g_new0(struct journal, 1);
+   gchar *contents;
+   gsize length;
+
+   j->done = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+   if (g_file_get_contents(path, &contents, &length, NULL)) {
+      journal_load(j, contents, length);
+      g_free(contents);
+   }
+
+   j->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+   if (j->fd < 0) {
+      g_set_error(error, BLIT_ERROR, BLIT_ERROR_IO,
+                  "Unable to open journal %s: %s", path, g_strerror(errno));
+      g_hash_table_destroy(j->done);
+      g_free(j);
+      return NULL;
+   }
+
+   /* Terminate a torn line so the next entry starts on its own. */
+   off_t size = lseek(j->fd, 0, SEEK_END);
+   if (size > 0) {
+      char last;
+      if (pread(j->fd, &last, 1, size - 1) == 1 && last != '\n' &&
+          write(j->fd, "\n", 1) != 1)
+         g_warning("Unable to repair the journal: %s", g_strerror(errno));
+   }
+
+   g_mutex_init(&j->lock);
+   g_cond_init(&j->cond);
+   j->last_sync = g_get_monotonic_time();
+   if (sync_thread)
+      j->thread = g_thread_new("blit-journal", journal_thread, j);
+
+   if (g_hash_table_size(j->done) > 0)
+      g_info("%s: %u jobs already done\n", path, g_hash_table_size(j->done));
+
+   return j;
+}
+
+bool
+journal_contains(struct journal *j, const char *id)
+{
+   return g_hash_table_contains(j->done, id);
+}
+
+/* Called from the pipeline thread as jobs complete. */
+void
+journal_append(struct journal *j, const char *id, const char *hash)
+{
+   gchar *line = g_strdup_printf("%s %s\n", id, hash ? hash : "-");
+   size_t len = strlen(line);
+
+   /* O_APPEND writes of a single line don't interleave. */
+   if (write(j->fd, line, len) != (ssize_t) len)
+      g_warning("Short write to the journal: %s", g_strerror(errno));
+   g_free(line);
+
+   g_mutex_lock(&j->lock);
+   j->unsynced++;
+   if (j->thread) {
+      if (j->unsynced >= JOURNAL_SYNC_ENTRIES)
+         g_cond_signal(&j->cond);
+   } else {
+      gint64 now = g_get_monotonic_time();
+
+      if (j->unsynced >= JOURNAL_SYNC_ENTRIES || now - j->last_sync >= JOURNAL_SYNC_USEC) {
+         fdatasync(j->fd);
+         j->unsynced = 0;
+         j->last_sync = now;
+      }
+   }
+   g_mutex_unlock(&j->lock);
+}
+
+void
+journal_close(struct journal *j)
+{
+   if (j->thread) {
+      g_mutex_lock(&j->lock);
+      j->closing = true;
+      g_cond_signal(&j->cond);
+      g_mutex_unlock(&j->lock);
+      g_thread_join(j->thread);
+   }
+
+   fdatasync(j->fd);
+   close(j->fd);
+
+   g_hash_table_destroy(j->done);
+   g_mutex_clear(&j->lock);
+   g_cond_clear(&j->cond);
+   g_free(j);
+}
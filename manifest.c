@@ -0,0 +1,152 @@
+/*
+ * Copyright © 2021 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "blit.h"
+
+#define MAX_VARIANTS 16
+
+/*
+ * A manifest lists one job per line, either as "input output" or as
+ * "id input output", optionally followed by the WxH+X+Y crops to write
+ * and the WxH sizes to scale the result to.
+ * Empty lines and lines starting with '#' are ignored. Without an explicit
+ * id, the output path identifies the job.
+ *
+ * An input of "@id" or "@id:WxH" starts from the result of another job, on
+ * the GPU (see registry.c), and an output of "-" keeps a result there only.
+ */
+GPtrArray *
+manifest_load(const char *path, GError **error)
+{
+   gchar *contents;
+
+   if (!g_file_get_contents(path, &contents, NULL, error))
+      return NULL;
+
+   GPtrArray *jobs = g_ptr_array_new();
+   gchar **lines = g_strsplit(contents, "\n", -1);
+   bool ok = true;
+
+   for (unsigned i = 0; ok && lines[i]; i++) {
+      gchar *line = g_strstrip(lines[i]);
+
+      if (line[0] == '\0' || line[0] == '#')
+         continue;
+
+      gchar **fields = g_strsplit_set(line, " \t", -1);
+      const char *f[3];
+      unsigned n = 0, n_variants = 0;
+      const char *variants[MAX_VARIANTS];
+
+      /* Crops and sizes follow the names. */
+      for (unsigned j = 0; fields[j]; j++) {
+         struct rect rect;
+
+         if (fields[j][0] == '\0')
+            continue;
+         if (n >= 2 && n_variants < G_N_ELEMENTS(variants) &&
+             (rect_parse(fields[j], &rect) || size_parse(fields[j], &rect))) {
+            variants[n_variants++] = fields[j];
+            continue;
+         }
+         if (n == G_N_ELEMENTS(f) || n_variants > 0) {
+            n = G_N_ELEMENTS(f) + 1;
+            break;
+         }
+         f[n++] = fields[j];
+      }
+
+      struct job *job = NULL;
+      if (n == 2) {
+         job = job_new(NULL, f[0], f[1]);
+      } else if (n == 3) {
+         job = job_new(f[0], f[1], f[2]);
+      } else {
+         g_set_error(error, BLIT_ERROR, BLIT_ERROR_PARSE,
+                     "%s:%u: expected \"[id] input output [WxH+X+Y...] [WxH...]\"", path, i + 1);
+         ok = false;
+      }
+
+      if (job) {
+         for (unsigned j = 0; j < n_variants; j++)
+            job_add_variant(job, variants[j]);
+         g_ptr_array_add(jobs, job);
+      }
+
+      g_strfreev(fields);
+   }
+
+   g_strfreev(lines);
+   g_free(contents);
+
+   if (!ok) {
+      for (unsigned i = 0; i < jobs->len; i++)
+         job_free(g_ptr_array_index(jobs, i));
+      g_ptr_array_free(jobs, TRUE);
+      return NULL;
+   }
+
+   return jobs;
+}
+
+/* Counts the readers of each job's result into job->keep. Fails if a
+ * chained input names a job that isn't in jobs.
+ */
+bool
+manifest_link(GPtrArray *jobs, unsigned *n_chained, GError **error)
+{
+   GHashTable *ids = g_hash_table_new(g_str_hash, g_str_equal);
+   bool ok = true;
+
+   *n_chained = 0;
+   for (unsigned i = 0; i < jobs->len; i++) {
+      struct job *job = g_ptr_array_index(jobs, i);
+
+      job->keep = 0;
+      g_hash_table_insert(ids, job->id, job);
+   }
+
+   for (unsigned i = 0; ok && i < jobs->len; i++) {
+      struct job *job = g_ptr_array_index(jobs, i);
+      uint32_t width, height;
+      char *id;
+
+      if (!chain_input(job->input, &id, &width, &height))
+         continue;
+
+      struct job *producer = g_hash_table_lookup(ids, id);
+      if (producer && producer != job) {
+         producer->keep++;
+         (*n_chained)++;
+      } else {
+         g_set_error(error, BLIT_ERROR, BLIT_ERROR_PARSE,
+                     "%s: no job %s to start from", job->id, id);
+         ok = false;
+      }
+      g_free(id);
+   }
+
+   g_hash_table_destroy(ids);
+
+   return ok;
+}
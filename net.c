@@ -0,0 +1,212 @@
+/*
+ * Copyright © 2021 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Helpers for the line-based protocol spoken between the coordinator and
+ * the daemons. Every message is a single '\n' terminated line of
+ * space-separated words, so ids and paths must not contain whitespace
+ * (the manifest format already requires that).
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "blit.h"
+
+/* Splits "host:port" or ":port"/"port" (host may be NULL). */
+static bool
+split_address(const char *address, char **host, char **port, GError **error)
+{
+   const char *colon = strrchr(address, ':');
+
+   *host = colon && colon != address ? g_strndup(address, colon - address) : NULL;
+   *port = g_strdup(colon ? colon + 1 : address);
+
+   if ((*port)[0] == '\0') {
+      g_set_error(error, BLIT_ERROR, BLIT_ERROR_PARSE, "Missing port in \"%s\"", address);
+      g_free(*host);
+      g_free(*port);
+      return false;
+   }
+
+   return true;
+}
+
+/* Like connect(), but gives up after NET_TIMEOUT so a dead node can't hang
+ * the coordinator.
+ */
+static bool
+connect_timeout(int fd, const struct sockaddr *addr, socklen_t len)
+{
+   int flags = fcntl(fd, F_GETFL);
+
+   fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+   bool ok = connect(fd, addr, len) == 0;
+   if (!ok && errno == EINPROGRESS) {
+      struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+      int ret;
+
+      do {
+         ret = poll(&pfd, 1, NET_TIMEOUT);
+      } while (ret < 0 && errno == EINTR);
+
+      int err = ret ? errno : ETIMEDOUT;
+      socklen_t size = sizeof(err);
+      if (ret > 0)
+         getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &size);
+
+      ok = err == 0;
+      errno = err;
+   }
+   fcntl(fd, F_SETFL, flags);
+
+   return ok;
+}
+
+static int
+open_socket(const char *address, bool server, GError **error)
+{
+   char *host, *port;
+
+   if (!split_address(address, &host, &port, error))
+      return -1;
+
+   struct addrinfo *res, hints = {
+      .ai_family = AF_UNSPEC,
+      .ai_socktype = SOCK_STREAM,
+      .ai_flags = server ? AI_PASSIVE : 0,
+   };
+   int err = getaddrinfo(host, port, &hints, &res);
+   g_free(host);
+   g_free(port);
+   if (err) {
+      g_set_error(error, BLIT_ERROR, BLIT_ERROR_IO, "%s: %s", address, gai_strerror(err));
+      return -1;
+   }
+
+   int fd = -1, saved_errno = 0;
+   for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+      fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+      if (fd < 0) {
+         saved_errno = errno;
+         continue;
+      }
+
+      int one = 1;
+      bool ok;
+      if (server) {
+         setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+         ok = bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0;
+      } else {
+         setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+         ok = connect_timeout(fd, ai->ai_addr, ai->ai_addrlen);
+      }
+
+      if (!ok) {
+         saved_errno = errno;
+         close(fd);
+         fd = -1;
+      }
+   }
+   freeaddrinfo(res);
+
+   if (fd < 0)
+      g_set_error(error, BLIT_ERROR, BLIT_ERROR_IO, "%s: %s", address, g_strerror(saved_errno));
+
+   return fd;
+}
+
+int
+net_listen(const char *address, GError **error)
+{
+   return open_socket(address, true, error);
+}
+
+int
+net_connect(const char *address, GError **error)
+{
+   return open_socket(address, false, error);
+}
+
+bool
+net_send(int fd, const char *format, ...)
+{
+   va_list args;
+
+   va_start(args, format);
+   gchar *line = g_strdup_vprintf(format, args);
+   va_end(args);
+
+   size_t len = strlen(line), sent = 0;
+   while (sent < len) {
+      ssize_t ret = send(fd, line + sent, len - sent, MSG_NOSIGNAL);
+      if (ret < 0 && errno == EINTR)
+         continue;
+      if (ret <= 0)
+         break;
+      sent += ret;
+   }
+   g_free(line);
+
+   return sent == len;
+}
+
+/* Reads what's available on fd and calls cb for each complete line, with
+ * its words split. Returns false on EOF or error.
+ */
+bool
+net_receive(int fd, GString *buffer, net_line_cb cb, void *user_data)
+{
+   char data[4096];
+   ssize_t len = recv(fd, data, sizeof(data), 0);
+
+   if (len < 0 && errno == EINTR)
+      return true;
+   if (len <= 0)
+      return false;
+
+   g_string_append_len(buffer, data, len);
+
+   char *eol;
+   while ((eol = memchr(buffer->str, '\n', buffer->len))) {
+      gsize line_len = eol - buffer->str;
+      gchar *line = g_strndup(buffer->str, line_len);
+      gchar **words = g_strsplit(g_strstrip(line), " ", -1);
+
+      if (words[0] && words[0][0])
+         cb(words, user_data);
+
+      g_strfreev(words);
+      g_free(line);
+      g_string_erase(buffer, 0, line_len + 1);
+   }
+
+   return true;
+}
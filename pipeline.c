@@ -0,0 +1,694 @@
+/*
+ * Copyright © 2021 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Jobs are decoded by a pool of readahead threads and handed to a single
+ * submission thread which owns the queue and a ring of slots. A slot is only
+ * waited on when it needs to be reused or when nothing else is ready, so the
+ * decode of job k+1 overlaps the GPU work of job k.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blit.h"
+
+struct pipeline {
+   struct data *vc;
+
+   job_done_cb done;
+   void *user_data;
+
+   GThreadPool *readahead;
+   GAsyncQueue *ready;
+   GThread *thread;
+
+   /* Bounds the number of decoded jobs waiting for a slot. */
+   GMutex lock;
+   GCond cond;
+   unsigned pending, max_pending;
+
+   struct slot *slots;
+   unsigned n_slots, head, n_busy;
+
+   /* Jobs lost with the device, decoded again and resubmitted first. */
+   GQueue retry;
+
+   /* Chained jobs waiting for the job they start from to be submitted. */
+   GQueue parked;
+};
+
+/* Pushed on the ready queue once all the jobs have been queued. */
+static struct job finish_job;
+
+/* Times a job may be lost along with the device before it is failed. */
+#define MAX_LOST 2
+
+/* Frames taken from an animated input, at most. */
+#define MAX_FRAMES 1024
+
+struct job *
+job_new(const char *id, const char *input, const char *output)
+{
+   struct job *job = g_new0(struct job, 1);
+
+   job->id = g_strdup(id ? id : output);
+   job->input = g_strdup(input);
+   job->output = g_strdup(output);
+
+   return job;
+}
+
+void
+job_free(struct job *job)
+{
+   g_clear_object(&job->pixbuf);
+   g_clear_error(&job->error);
+   g_free(job->id);
+   g_free(job->input);
+   g_free(job->output);
+   g_free(job->output_hash);
+   g_free(job->crops);
+   g_free(job->scales);
+   if (job->frames)
+      g_ptr_array_unref(job->frames);
+   g_strfreev(job->frame_hashes);
+   g_free(job);
+}
+
+/* Parses X geometries, WIDTHxHEIGHT+X+Y. */
+bool
+rect_parse(const char *str, struct rect *rect)
+{
+   int n = 0;
+
+   return sscanf(str, "%ux%u+%u+%u%n", &rect->width, &rect->height, &rect->x, &rect->y, &n) == 4 &&
+          str[n] == '\0' && rect->width > 0 && rect->height > 0;
+}
+
+/* Parses sizes, WIDTHxHEIGHT. */
+bool
+size_parse(const char *str, struct rect *rect)
+{
+   int n = 0;
+
+   *rect = (struct rect) { 0, };
+
+   return sscanf(str, "%ux%u%n", &rect->width, &rect->height, &n) == 2 &&
+          str[n] == '\0' && rect->width > 0 && rect->height > 0;
+}
+
+void
+job_add_crop(struct job *job, const struct rect *rect)
+{
+   job->crops = g_renew(struct rect, job->crops, job->n_crops + 1);
+   job->crops[job->n_crops++] = *rect;
+}
+
+void
+job_add_scale(struct job *job, const struct rect *rect)
+{
+   job->scales = g_renew(struct rect, job->scales, job->n_scales + 1);
+   job->scales[job->n_scales++] = *rect;
+}
+
+/* Adds a crop for WxH+X+Y or a scaled copy for WxH. */
+bool
+job_add_variant(struct job *job, const char *str)
+{
+   struct rect rect;
+
+   if (rect_parse(str, &rect))
+      job_add_crop(job, &rect);
+   else if (size_parse(str, &rect))
+      job_add_scale(job, &rect);
+   else
+      return false;
+
+   return true;
+}
+
+/* The uploads, --delta, --sparse and the checksums all take 4 bytes per
+ * pixel: inputs without alpha, such as JPEGs, get an opaque one. Returns a
+ * new reference, or with copy set a copy, if pixbuf has one already.
+ */
+static GdkPixbuf *
+rgba_pixbuf(GdkPixbuf *pixbuf, bool copy)
+{
+   if (gdk_pixbuf_get_n_channels(pixbuf) != 4)
+      return gdk_pixbuf_add_alpha(pixbuf, FALSE, 0, 0, 0);
+
+   return copy ? gdk_pixbuf_copy(pixbuf) : g_object_ref(pixbuf);
+}
+
+/* Whether the animation is back on its first frame at time, which is a
+ * frame boundary: a new iterator advanced there then reports no change.
+ */
+static bool
+loops_at(GdkPixbufAnimation *anim, const GTimeVal *time)
+{
+   G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+   GTimeVal start = { 0, 0 };
+   GdkPixbufAnimationIter *iter = gdk_pixbuf_animation_get_iter(anim, &start);
+   bool changed = gdk_pixbuf_animation_iter_advance(iter, time);
+   G_GNUC_END_IGNORE_DEPRECATIONS
+
+   g_object_unref(iter);
+
+   return !changed;
+}
+
+/* An animation has no frame count: its frames are played from the start
+ * until the first one comes around again, or the last one stays up
+ * forever. Frame numbers only depend on the file, a frame lost with the
+ * device gets the same one when decoded again.
+ */
+static GPtrArray *
+decode_frames(GdkPixbufAnimation *anim, const char *input)
+{
+   GPtrArray *frames = g_ptr_array_new_with_free_func(g_object_unref);
+   G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+   GTimeVal time = { 0, 0 };
+   GdkPixbufAnimationIter *iter = gdk_pixbuf_animation_get_iter(anim, &time);
+
+   for (;;) {
+      g_ptr_array_add(frames, rgba_pixbuf(gdk_pixbuf_animation_iter_get_pixbuf(iter), true));
+
+      int delay = gdk_pixbuf_animation_iter_get_delay_time(iter);
+      if (delay < 0)
+         break;
+      g_time_val_add(&time, MAX(delay, 1) * 1000);
+      if (loops_at(anim, &time))
+         break;
+
+      if (frames->len == MAX_FRAMES) {
+         g_warning("%s: only the first %u frames are taken", input, MAX_FRAMES);
+         break;
+      }
+      gdk_pixbuf_animation_iter_advance(iter, &time);
+   }
+
+   g_object_unref(iter);
+   G_GNUC_END_IGNORE_DEPRECATIONS
+
+   return frames;
+}
+
+/* Inputs may have been decoded ahead of time (see main()). */
+void
+job_decode(struct job *job)
+{
+   /* Chained jobs start from a result already on the GPU. */
+   if (job->pixbuf || job->frames || job->error || job->input[0] == '@')
+      return;
+
+   GdkPixbufAnimation *anim = gdk_pixbuf_animation_new_from_file(job->input, &job->error);
+   if (!anim)
+      return;
+
+   if (gdk_pixbuf_animation_is_static_image(anim)) {
+      job->pixbuf = rgba_pixbuf(gdk_pixbuf_animation_get_static_image(anim), false);
+   } else if (!job->parent) {
+      job->frames = decode_frames(anim, job->input);
+   } else {
+      /* A frame lost with the device, decoded again. */
+      GPtrArray *frames = decode_frames(anim, job->input);
+
+      if (job->frame < frames->len)
+         job->pixbuf = g_object_ref(g_ptr_array_index(frames, job->frame));
+      else
+         g_set_error(&job->error, BLIT_ERROR, BLIT_ERROR_IO, "%s has no frame %u", job->input, job->frame);
+      g_ptr_array_unref(frames);
+   }
+   g_object_unref(anim);
+
+   if (job->pixbuf && gpu_verify)
+      checksum_pixbuf(job->pixbuf, job->source_hash);
+}
+
+static void complete_job(struct pipeline *p, struct job *job, bool success);
+
+/* The hash of an animated input's outputs is the SHA-256 of the hashes of
+ * its frames, in order.
+ */
+static void
+complete_frame(struct pipeline *p, struct job *frame, bool success)
+{
+   struct job *job = frame->parent;
+
+   if (success)
+      job->frame_hashes[frame->frame] = g_steal_pointer(&frame->output_hash);
+   else
+      job->frame_failed = true;
+   job_free(frame);
+
+   if (--job->pending_frames > 0)
+      return;
+
+   if (job->checksum && !job->frame_failed) {
+      GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+
+      for (unsigned i = 0; job->frame_hashes[i]; i++)
+         g_checksum_update(checksum, (const guchar *) job->frame_hashes[i], -1);
+      job->output_hash = g_strdup(g_checksum_get_string(checksum));
+      g_checksum_free(checksum);
+   }
+
+   complete_job(p, job, !job->frame_failed);
+}
+
+static void
+complete_job(struct pipeline *p, struct job *job, bool success)
+{
+   if (job->source)
+      registry_unref(p->vc, job->source);
+   if (job->keep > 0)
+      registry_release(p->vc, job->id);
+
+   if (job->replay) {
+      job_free(job);
+      return;
+   }
+
+   if (job->parent) {
+      complete_frame(p, job, success);
+      return;
+   }
+
+   if (p->done)
+      p->done(job, success, p->user_data);
+   job_free(job);
+}
+
+/* A decoded job, or frame, got a slot. */
+static void
+drop_pending(struct pipeline *p, unsigned n)
+{
+   g_mutex_lock(&p->lock);
+   p->pending -= n;
+   g_cond_signal(&p->cond);
+   g_mutex_unlock(&p->lock);
+}
+
+static void
+lose_job(struct pipeline *p, struct job *job)
+{
+   /* The image goes with the device and the job looks its source up
+    * again, the reference stays, see registry_replay().
+    */
+   if (++job->lost > MAX_LOST) {
+      g_warning("%s: lost with the device %u times, giving up", job->input, job->lost);
+      complete_job(p, job, false);
+   } else {
+      job->source = NULL;
+      g_queue_push_tail(&p->retry, job);
+   }
+}
+
+/* Nothing in flight can be trusted after a device loss: put it all back and
+ * bring up a new context. The warm resources and recorded command buffers
+ * of the slots are recreated lazily, as they get used again.
+ */
+static void
+recover_device(struct pipeline *p, struct job *submitting)
+{
+   gint64 start = g_get_monotonic_time();
+   struct job *lost[p->n_busy + 1];
+   unsigned n_lost = 0;
+
+   for (unsigned i = 0; i < p->n_busy; i++) {
+      struct slot *slot = &p->slots[(p->head + i) % p->n_slots];
+
+      lost[n_lost++] = slot->job;
+      slot->job = NULL;
+   }
+   if (submitting)
+      lost[n_lost++] = submitting;
+   p->head = p->n_busy = 0;
+
+   for (unsigned i = 0; i < p->n_slots; i++)
+      slot_fini(p->vc, &p->slots[i]);
+   fini_vk(p->vc);
+
+   init_vk(p->vc);
+   for (unsigned i = 0; i < p->n_slots; i++)
+      slot_init(p->vc, &p->slots[i]);
+
+   /* Once the registry's images are gone, so that a producer given up on
+    * has the jobs reading it fail.
+    */
+   unsigned requeued = n_lost;
+   for (unsigned i = 0; i < n_lost; i++)
+      lose_job(p, lost[i]);
+
+   /* The results still to be read whose producer had retired. */
+   GPtrArray *replays = registry_replay(p->vc);
+   for (unsigned i = 0; i < replays->len; i++)
+      g_queue_push_tail(&p->retry, g_ptr_array_index(replays, i));
+   requeued += replays->len;
+   g_ptr_array_free(replays, TRUE);
+
+   g_warning("Device lost, context rebuilt in %.1f ms, %u jobs requeued",
+             (g_get_monotonic_time() - start) / 1000.0, requeued);
+}
+
+static bool
+device_lost(struct pipeline *p, VkResult res, struct job *submitting)
+{
+   if (res != VK_ERROR_DEVICE_LOST)
+      return false;
+
+   if (p->vc->device_lost)
+      p->vc->device_lost(p->vc);
+
+   recover_device(p, submitting);
+
+   return true;
+}
+
+static void
+retire_oldest(struct pipeline *p)
+{
+   struct slot *slot = &p->slots[p->head];
+
+   if (device_lost(p, slot_wait(p->vc, slot), NULL))
+      return;
+
+   complete_job(p, slot->job, slot_write_output(p->vc, slot));
+   slot->job = NULL;
+
+   p->head = (p->head + 1) % p->n_slots;
+   p->n_busy--;
+}
+
+static void unpark(struct pipeline *p);
+
+/* Looks up the result a chained job starts from. Returns false if the job
+ * was parked or failed instead.
+ */
+static bool
+find_source(struct pipeline *p, struct job *job)
+{
+   uint32_t width, height;
+   bool failed;
+   char *id;
+
+   if (job->source || !chain_input(job->input, &id, &width, &height))
+      return true;
+
+   job->source = registry_lookup(p->vc, id, &failed);
+   job->scale_width = width;
+   job->scale_height = height;
+
+   if (!job->source && !failed) {
+      g_queue_push_tail(&p->parked, job);
+   } else if (!job->source) {
+      g_warning("%s: the result of %s isn't available", job->id, id);
+      complete_job(p, job, false);
+   }
+   g_free(id);
+
+   return job->source != NULL;
+}
+
+static void submit_frames(struct pipeline *p, struct job *job);
+
+static void
+submit_job(struct pipeline *p, struct job *job)
+{
+   if (job->error) {
+      g_warning("Unable to load image: %s", job->error->message);
+      complete_job(p, job, false);
+      return;
+   }
+
+   if (job->frames) {
+      submit_frames(p, job);
+      return;
+   }
+
+   /* Before looking up the source: a device loss while retiring takes the
+    * registry's images along.
+    */
+   if (p->n_busy == p->n_slots)
+      retire_oldest(p);
+
+   if (!find_source(p, job))
+      return;
+
+   struct slot *slot = &p->slots[(p->head + p->n_busy) % p->n_slots];
+
+   if (!slot_prepare(p->vc, slot, job)) {
+      slot->job = NULL;
+      complete_job(p, job, false);
+      return;
+   }
+
+   /* The pixels now live in the staging buffer. */
+   g_clear_object(&job->pixbuf);
+
+   if (device_lost(p, slot_submit(p->vc, slot), job))
+      return;
+
+   p->n_busy++;
+
+   if (job->keep > 0) {
+      slot_export_image(p->vc, slot, job->id, job->keep);
+      unpark(p);
+   }
+}
+
+/* Submits a job per frame of an animated input, back to back. The frames
+ * count as decoded jobs from readahead_job() on, each is let go of as it
+ * gets a slot.
+ */
+static void
+submit_frames(struct pipeline *p, struct job *job)
+{
+   GPtrArray *frames = g_steal_pointer(&job->frames);
+
+   g_ptr_array_set_free_func(frames, NULL);
+   job->pending_frames = frames->len;
+   job->frame_hashes = g_new0(char *, frames->len + 1);
+
+   for (unsigned i = 0; i < frames->len; i++) {
+      char *id = g_strdup_printf("%s#%u", job->id, i);
+      char *suffix = g_strdup_printf("%04u", i);
+      char *output = output_name_with_suffix(job->output, suffix);
+      struct job *frame = job_new(id, job->input, output);
+
+      frame->parent = job;
+      frame->frame = i;
+      frame->checksum = job->checksum;
+      for (unsigned j = 0; j < job->n_crops; j++)
+         job_add_crop(frame, &job->crops[j]);
+      for (unsigned j = 0; j < job->n_scales; j++)
+         job_add_scale(frame, &job->scales[j]);
+      frame->pixbuf = g_ptr_array_index(frames, i);
+      if (gpu_verify)
+         checksum_pixbuf(frame->pixbuf, frame->source_hash);
+
+      g_free(id);
+      g_free(suffix);
+      g_free(output);
+
+      submit_job(p, frame);
+
+      /* The first frame went with the job. */
+      if (i > 0)
+         drop_pending(p, 1);
+   }
+
+   g_ptr_array_unref(frames);
+}
+
+/* Submits the jobs that were waiting, or parks them again. */
+static void
+unpark(struct pipeline *p)
+{
+   GQueue parked = p->parked;
+   struct job *job;
+
+   g_queue_init(&p->parked);
+   while ((job = g_queue_pop_head(&parked)))
+      submit_job(p, job);
+}
+
+static void
+resubmit_lost_job(struct pipeline *p)
+{
+   struct job *job = g_queue_pop_head(&p->retry);
+
+   /* The readahead pool may be going away, this is rare enough to decode
+    * here.
+    */
+   job_decode(job);
+   submit_job(p, job);
+}
+
+static gpointer
+pipeline_thread(gpointer data)
+{
+   struct pipeline *p = data;
+
+   for (;;) {
+      struct job *job;
+
+      /* Retire what the GPU already finished without blocking. */
+      while (p->n_busy > 0 && slot_poll(p->vc, &p->slots[p->head]))
+         retire_oldest(p);
+
+      if (p->retry.length > 0) {
+         resubmit_lost_job(p);
+         continue;
+      }
+
+      if (p->n_busy > 0) {
+         job = g_async_queue_timeout_pop(p->ready, 1000);
+         if (!job)
+            continue;
+      } else {
+         job = g_async_queue_pop(p->ready);
+      }
+
+      if (job == &finish_job)
+         break;
+
+      drop_pending(p, 1);
+      submit_job(p, job);
+   }
+
+   while (p->n_busy > 0 || p->retry.length > 0) {
+      if (p->retry.length > 0)
+         resubmit_lost_job(p);
+      else
+         retire_oldest(p);
+   }
+
+   /* Whatever is still parked starts from a job that failed. */
+   struct job *job;
+   while ((job = g_queue_pop_head(&p->parked))) {
+      g_warning("%s: the result of %s never came", job->id, job->input + 1);
+      complete_job(p, job, false);
+   }
+
+   return NULL;
+}
+
+static void
+readahead_job(gpointer data, gpointer user_data)
+{
+   struct job *job = data;
+   struct pipeline *p = user_data;
+
+   job_decode(job);
+
+   /* Every frame is held until it gets a slot, see submit_frames(). */
+   if (job->frames && job->frames->len > 1) {
+      g_mutex_lock(&p->lock);
+      p->pending += job->frames->len - 1;
+      g_mutex_unlock(&p->lock);
+   }
+
+   g_async_queue_push(p->ready, job);
+}
+
+struct pipeline *
+pipeline_create(struct data *vc, unsigned depth, job_done_cb done, void *user_data)
+{
+   struct pipeline *p = g_new0(struct pipeline, 1);
+
+   if (depth == 0)
+      depth = tuned_depth(vc);
+
+   p->vc = vc;
+   p->done = done;
+   p->user_data = user_data;
+
+   p->n_slots = depth;
+   p->slots = g_new0(struct slot, depth);
+   for (unsigned i = 0; i < depth; i++)
+      slot_init(vc, &p->slots[i]);
+
+   g_queue_init(&p->retry);
+   g_queue_init(&p->parked);
+   g_mutex_init(&p->lock);
+   g_cond_init(&p->cond);
+   p->max_pending = 2 * depth;
+
+   p->ready = g_async_queue_new();
+   p->readahead = g_thread_pool_new(readahead_job, p,
+                                    MIN(depth, g_get_num_processors()),
+                                    FALSE, NULL);
+   p->thread = g_thread_new("blit-submit", pipeline_thread, p);
+
+   return p;
+}
+
+void
+pipeline_queue(struct pipeline *p, struct job *job)
+{
+   g_mutex_lock(&p->lock);
+   while (p->pending >= p->max_pending)
+      g_cond_wait(&p->cond, &p->lock);
+   p->pending++;
+   g_mutex_unlock(&p->lock);
+
+   /* Get the page cache going before a decode thread picks the job up. */
+   int fd = job->input[0] == '@' ? -1 : open(job->input, O_RDONLY | O_CLOEXEC);
+   if (fd >= 0) {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+      close(fd);
+   }
+
+   g_thread_pool_push(p->readahead, job, NULL);
+}
+
+/* Jobs that can be queued without blocking: in flight or read ahead. */
+unsigned
+pipeline_capacity(struct pipeline *p)
+{
+   return p->n_slots + p->max_pending;
+}
+
+void
+pipeline_finish(struct pipeline *p)
+{
+   /* Waits for all the queued decodes to land on the ready queue. */
+   g_thread_pool_free(p->readahead, FALSE, TRUE);
+
+   g_async_queue_push(p->ready, &finish_job);
+   g_thread_join(p->thread);
+
+   for (unsigned i = 0; i < p->n_slots; i++)
+      slot_fini(p->vc, &p->slots[i]);
+   g_free(p->slots);
+
+   g_async_queue_unref(p->ready);
+   g_mutex_clear(&p->lock);
+   g_cond_clear(&p->cond);
+   g_free(p);
+}
@@ -0,0 +1,370 @@
+/*
+ * Copyright © 2021 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Runs a manifest with K pre-forked worker processes, each owning its own
+ * warm Vulkan context. The job list itself is inherited through fork(); only
+ * the job states live in a shared mapping, where workers claim pending jobs
+ * under a robust process-shared mutex.
+ *
+ * A worker exits with WORKER_EXIT_DEVICE_LOST when its device is lost (and
+ * may as well crash on a protected content fault): the supervisor puts the
+ * jobs it had claimed back in the queue and forks a replacement, while the
+ * other workers keep going.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "blit.h"
+
+#define WORKER_EXIT_DEVICE_LOST 3
+
+/* Attempts before a job that keeps taking its worker down is failed. */
+#define MAX_ATTEMPTS 3
+
+enum job_state {
+   JOB_PENDING,
+   JOB_RUNNING,
+   JOB_DONE,
+   JOB_FAILED,
+};
+
+struct shared_job {
+   enum job_state state;
+   int worker;
+   int attempts;
+   char hash[65];
+
+   /* Set by the supervisor once it accounted for the job. */
+   bool reported;
+};
+
+struct queue {
+   pthread_mutex_t lock;
+   unsigned first_pending;
+   unsigned n_jobs;
+   struct shared_job jobs[];
+};
+
+static struct queue *queue;
+static int completion_fd;
+
+static void
+queue_lock(void)
+{
+   /* A worker may die while holding the lock. */
+   if (pthread_mutex_lock(&queue->lock) == EOWNERDEAD)
+      pthread_mutex_consistent(&queue->lock);
+}
+
+static void
+queue_unlock(void)
+{
+   pthread_mutex_unlock(&queue->lock);
+}
+
+static int
+queue_claim(int worker)
+{
+   int index = -1;
+
+   queue_lock();
+   for (unsigned i = queue->first_pending; i < queue->n_jobs; i++) {
+      if (queue->jobs[i].state == JOB_PENDING) {
+         queue->jobs[i].state = JOB_RUNNING;
+         queue->jobs[i].worker = worker;
+         queue->jobs[i].attempts++;
+         queue->first_pending = i + 1;
+         index = i;
+         break;
+      }
+   }
+   queue_unlock();
+
+   return index;
+}
+
+static void
+worker_done(struct job *job, bool success, void *user_data)
+{
+   int index = GPOINTER_TO_INT(job->data);
+   struct shared_job *sj = &queue->jobs[index];
+
+   queue_lock();
+   sj->state = success ? JOB_DONE : JOB_FAILED;
+   if (success && job->output_hash)
+      g_strlcpy(sj->hash, job->output_hash, sizeof(sj->hash));
+   queue_unlock();
+
+   /* Tell the supervisor, a single small write is atomic on a pipe. */
+   if (write(completion_fd, &index, sizeof(index)) != sizeof(index))
+      g_warning("Unable to notify the supervisor: %s", g_strerror(errno));
+}
+
+static void
+worker_device_lost(struct data *vc)
+{
+   _exit(WORKER_EXIT_DEVICE_LOST);
+}
+
+static void
+worker_main(int worker, GPtrArray *jobs, bool checksum, unsigned depth)
+{
+   struct data data = { .device_lost = worker_device_lost };
+
+   init_vk(&data);
+
+   struct pipeline *p = pipeline_create(&data, depth, worker_done, NULL);
+   int index;
+
+   while ((index = queue_claim(worker)) >= 0) {
+      const struct job *src = g_ptr_array_index(jobs, index);
+      struct job *job = job_new(src->id, src->input, src->output);
+
+      for (unsigned i = 0; i < src->n_crops; i++)
+         job_add_crop(job, &src->crops[i]);
+      for (unsigned i = 0; i < src->n_scales; i++)
+         job_add_scale(job, &src->scales[i]);
+      job->checksum = checksum;
+      job->data = GINT_TO_POINTER(index);
+      pipeline_queue(p, job);
+   }
+
+   pipeline_finish(p);
+   fini_vk(&data);
+
+   _exit(0);
+}
+
+static pid_t
+spawn_worker(int worker, GPtrArray *jobs, bool checksum, unsigned depth, int read_fd)
+{
+   pid_t pid = fork();
+
+   if (pid == 0) {
+      close(read_fd);
+      worker_main(worker, jobs, checksum, depth);
+   } else if (pid < 0) {
+      g_warning("fork: %s", g_strerror(errno));
+   }
+
+   return pid;
+}
+
+static bool
+queue_has_pending(void)
+{
+   bool pending = false;
+
+   queue_lock();
+   for (unsigned i = queue->first_pending; i < queue->n_jobs && !pending; i++)
+      pending = queue->jobs[i].state == JOB_PENDING;
+   queue_unlock();
+
+   return pending;
+}
+
+struct supervisor {
+   GPtrArray *jobs;
+   struct journal *journal;
+   int read_fd;
+   unsigned remaining, done, failed;
+   unsigned crashes_without_progress;
+};
+
+static void
+account_job(struct supervisor *s, unsigned index)
+{
+   struct shared_job *sj = &queue->jobs[index];
+   const struct job *job = g_ptr_array_index(s->jobs, index);
+
+   if (sj->reported)
+      return;
+   sj->reported = true;
+
+   s->remaining--;
+   if (sj->state == JOB_DONE) {
+      s->done++;
+      if (s->journal)
+         journal_append(s->journal, job->id, sj->hash[0] ? sj->hash : NULL);
+   } else {
+      s->failed++;
+   }
+}
+
+/* Accounts for the completions workers reported, returns false once none
+ * arrived within timeout milliseconds.
+ */
+static bool
+read_completions(struct supervisor *s, int timeout)
+{
+   struct pollfd pfd = { .fd = s->read_fd, .events = POLLIN };
+   int indices[64];
+
+   if (poll(&pfd, 1, timeout) <= 0)
+      return false;
+
+   ssize_t len = read(s->read_fd, indices, sizeof(indices));
+   if (len <= 0)
+      return false;
+
+   for (unsigned i = 0; i < len / sizeof(int); i++)
+      account_job(s, indices[i]);
+   s->crashes_without_progress = 0;
+
+   return true;
+}
+
+/* Accounts for the jobs a dead worker completed without getting to report
+ * them, and puts back the ones it was running, or fails them after
+ * MAX_ATTEMPTS.
+ */
+static void
+reap_worker_jobs(struct supervisor *s, int worker)
+{
+   queue_lock();
+   for (unsigned i = 0; i < queue->n_jobs; i++) {
+      struct shared_job *sj = &queue->jobs[i];
+
+      if (sj->worker != worker || sj->reported)
+         continue;
+
+      if (sj->state == JOB_DONE || sj->state == JOB_FAILED) {
+         s->crashes_without_progress = 0;
+      } else if (sj->state != JOB_RUNNING) {
+         continue;
+      } else if (sj->attempts >= MAX_ATTEMPTS) {
+         sj->state = JOB_FAILED;
+      } else {
+         sj->state = JOB_PENDING;
+         queue->first_pending = MIN(queue->first_pending, i);
+         continue;
+      }
+      account_job(s, i);
+   }
+   queue_unlock();
+}
+
+int
+prefork_run(GPtrArray *jobs, struct journal *journal, unsigned n_workers, unsigned depth)
+{
+   size_t size = sizeof(struct queue) + jobs->len * sizeof(struct shared_job);
+   struct supervisor s = {
+      .jobs = jobs,
+      .journal = journal,
+      .remaining = jobs->len,
+   };
+   unsigned restarts = 0;
+   int fds[2];
+
+   queue = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (queue == MAP_FAILED)
+      g_error("mmap: %s", g_strerror(errno));
+
+   pthread_mutexattr_t attr;
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+   pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+   pthread_mutex_init(&queue->lock, &attr);
+   pthread_mutexattr_destroy(&attr);
+   queue->n_jobs = jobs->len;
+
+   if (pipe2(fds, O_CLOEXEC) < 0)
+      g_error("pipe: %s", g_strerror(errno));
+   s.read_fd = fds[0];
+   completion_fd = fds[1];
+
+   pid_t pids[n_workers];
+   unsigned alive = 0;
+   for (unsigned i = 0; i < n_workers; i++) {
+      pids[i] = spawn_worker(i, jobs, journal != NULL, depth, fds[0]);
+      if (pids[i] > 0)
+         alive++;
+   }
+
+   while (alive > 0) {
+      read_completions(&s, 100);
+
+      int status;
+      pid_t pid;
+      while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+         unsigned worker;
+
+         for (worker = 0; worker < n_workers && pids[worker] != pid; worker++)
+            ;
+         if (worker == n_workers)
+            continue;
+
+         pids[worker] = -1;
+         alive--;
+
+         if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            continue;
+
+         if (WIFEXITED(status) && WEXITSTATUS(status) == WORKER_EXIT_DEVICE_LOST)
+            g_warning("Worker %u lost its device, restarting it", worker);
+         else
+            g_warning("Worker %u died (status 0x%x), restarting it", worker, status);
+
+         /* Completions it reported before dying must not be requeued. */
+         while (read_completions(&s, 0))
+            ;
+         reap_worker_jobs(&s, worker);
+
+         if (++s.crashes_without_progress > MAX_ATTEMPTS * n_workers) {
+            g_warning("Workers keep dying without completing anything, giving up");
+            continue;
+         }
+
+         if (queue_has_pending()) {
+            pids[worker] = spawn_worker(worker, jobs, journal != NULL, depth, fds[0]);
+            if (pids[worker] > 0) {
+               alive++;
+               restarts++;
+            }
+         }
+      }
+   }
+
+   while (read_completions(&s, 0))
+      ;
+
+   /* Jobs left behind once the workers gave up. */
+   s.failed += s.remaining;
+
+   g_info("%u jobs done, %u failed, %u worker restarts\n", s.done, s.failed, restarts);
+
+   close(fds[0]);
+   close(fds[1]);
+   pthread_mutex_destroy(&queue->lock);
+   munmap(queue, size);
+
+   return s.failed ? 1 : 0;
+}
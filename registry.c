@@ -0,0 +1,232 @@
+/*
+ * Copyright © 2021 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Result images shared between jobs. A job whose input is "@id", or
+ * "@id:WxH" to scale it, starts from the dst_image of job id instead of a
+ * file, so chains of jobs never leave GPU memory. The producer hands its
+ * image over when it's submitted, with a reference for each job reading it
+ * plus its own, and the image is destroyed once all of them have retired.
+ *
+ * Only the pipeline thread uses the registry. The images belong to the
+ * device, but the entries outlive a device loss, with the references of
+ * the jobs still to read them: those producers that were lost along with
+ * the device add their image again when resubmitted, and those that had
+ * retired run again, see registry_replay().
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "blit.h"
+
+
+bool
+chain_input(const char *input, char **id, uint32_t *width, uint32_t *height)
+{
+   if (input[0] != '@')
+      return false;
+
+   const char *colon = strrchr(input, ':');
+   unsigned w, h;
+   int n = 0;
+
+   if (colon && sscanf(colon + 1, "%ux%u%n", &w, &h, &n) == 2 && colon[1 + n] == '\0' &&
+       w > 0 && h > 0) {
+      *id = g_strndup(input + 1, colon - input - 1);
+      *width = w;
+      *height = h;
+   } else {
+      *id = g_strdup(input + 1);
+      *width = *height = 0;
+   }
+
+   return true;
+}
+
+/* The entry stays, jobs hold on to it, and a device loss may have one
+ * read it again.
+ */
+static void
+destroy_image(struct data *vc, struct gpu_image *img)
+{
+   if (img->image == VK_NULL_HANDLE)
+      return;
+
+   vc->vk.DestroyImage(vc->device, img->image, NULL);
+   vc->vk.FreeMemory(vc->device, img->mem, NULL);
+   img->image = VK_NULL_HANDLE;
+   img->mem = VK_NULL_HANDLE;
+}
+
+static void
+free_entry(gpointer data)
+{
+   struct gpu_image *img = data;
+
+   g_free(img->input);
+   g_free(img);
+}
+
+static GHashTable *
+registry(struct data *vc)
+{
+   if (!vc->registry)
+      vc->registry = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_entry);
+
+   return vc->registry;
+}
+
+/* After a device loss, the entry is there already with the references of
+ * the jobs still to read it, which refs doesn't account for.
+ */
+void
+registry_add(struct data *vc, const char *id, const char *input, VkImage image, VkDeviceMemory mem,
+             VkQueue queue, uint32_t width, uint32_t height, unsigned refs)
+{
+   struct gpu_image *img = g_hash_table_lookup(registry(vc), id);
+
+   if (!img) {
+      img = g_new0(struct gpu_image, 1);
+      img->refcount = refs;
+      img->input = g_strdup(input);
+      g_hash_table_insert(registry(vc), g_strdup(id), img);
+   }
+
+   img->image = image;
+   img->mem = mem;
+   img->width = width;
+   img->height = height;
+   img->queue = queue;
+   img->retired = false;
+}
+
+/* The producer of id is done with it: drops its own reference, which kept
+ * the image around while it was in flight, or if it never got there, has
+ * the jobs reading id fail instead of waiting for it.
+ */
+void
+registry_release(struct data *vc, const char *id)
+{
+   struct gpu_image *img = g_hash_table_lookup(registry(vc), id);
+
+   if (!img) {
+      img = g_new0(struct gpu_image, 1);
+      g_hash_table_insert(registry(vc), g_strdup(id), img);
+   }
+
+   /* Never added, or lost with the device and given up on. */
+   if (img->image == VK_NULL_HANDLE) {
+      img->failed = true;
+      return;
+   }
+
+   img->retired = true;
+   registry_unref(vc, img);
+}
+
+/* Returns NULL while id isn't there yet, or with *failed set if it never
+ * will be. Producers and consumers share the process' protection, the
+ * registry doesn't outlive it.
+ */
+struct gpu_image *
+registry_lookup(struct data *vc, const char *id, bool *failed)
+{
+   struct gpu_image *img = g_hash_table_lookup(registry(vc), id);
+
+   *failed = img && img->failed;
+
+   return img && img->image ? img : NULL;
+}
+
+void
+registry_unref(struct data *vc, struct gpu_image *img)
+{
+   g_assert(img->refcount > 0);
+
+   if (--img->refcount == 0)
+      destroy_image(vc, img);
+}
+
+/* From fini_vk(): the images go with the device. */
+void
+registry_clear(struct data *vc)
+{
+   GHashTableIter iter;
+   gpointer value;
+
+   if (!vc->registry)
+      return;
+
+   g_hash_table_iter_init(&iter, vc->registry);
+   while (g_hash_table_iter_next(&iter, NULL, &value))
+      destroy_image(vc, value);
+}
+
+/* After a device loss, returns jobs producing again the results that are
+ * still to be read but whose producer had retired, each with a reference
+ * of its own. A result one of them starts from is produced again as well,
+ * if it was gone already.
+ */
+GPtrArray *
+registry_replay(struct data *vc)
+{
+   GPtrArray *jobs = g_ptr_array_new();
+   bool changed = true;
+
+   while (changed) {
+      GHashTableIter iter;
+      gpointer key, value;
+
+      changed = false;
+      g_hash_table_iter_init(&iter, registry(vc));
+      while (g_hash_table_iter_next(&iter, &key, &value)) {
+         struct gpu_image *img = value;
+         uint32_t width, height;
+         char *source;
+
+         if (!img->retired || img->refcount == 0)
+            continue;
+
+         struct job *job = job_new(key, img->input, "-");
+         job->keep = 1;
+         job->replay = true;
+         g_ptr_array_add(jobs, job);
+
+         img->refcount++;
+         img->retired = false;
+
+         if (chain_input(img->input, &source, &width, &height)) {
+            struct gpu_image *src = g_hash_table_lookup(registry(vc), source);
+
+            if (src) {
+               src->refcount++;
+               changed = true;
+            }
+            g_free(source);
+         }
+      }
+   }
+
+   return jobs;
+}
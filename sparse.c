@@ -0,0 +1,209 @@
+/*
+ * Copyright © 2021 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * --sparse creates dst_image with sparse residency and only binds memory
+ * to its blocks that have content, a block being empty when all of its
+ * pixels are 0 (transparent black). Only those blocks are uploaded and
+ * read back, the rest of the readback is cleared on the GPU. Device memory
+ * then scales with the content of a canvas rather than with its size.
+ *
+ * Sparse images can't be protected.
+ */
+
+#include "blit.h"
+
+bool
+sparse_image_init(struct data *vc, struct slot *slot)
+{
+   VkMemoryRequirements requirements;
+
+   vc->vk.CreateImage(vc->device,
+                      &(VkImageCreateInfo) {
+                         .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+                         .imageType = VK_IMAGE_TYPE_2D,
+                         .format = VK_FORMAT_R8G8B8A8_UNORM,
+                         .extent = { .width = slot->width, .height = slot->height, .depth = 1 },
+                         .mipLevels = 1,
+                         .arrayLayers = 1,
+                         .samples = 1,
+                         .tiling = VK_IMAGE_TILING_OPTIMAL,
+                         .usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+                         .flags = VK_IMAGE_CREATE_SPARSE_BINDING_BIT | VK_IMAGE_CREATE_SPARSE_RESIDENCY_BIT,
+                      },
+                      NULL,
+                      &slot->dst_image);
+
+   vc->vk.GetImageMemoryRequirements(vc->device, slot->dst_image, &requirements);
+
+   uint32_t count = 0;
+   vc->vk.GetImageSparseMemoryRequirements(vc->device, slot->dst_image, &count, NULL);
+   VkSparseImageMemoryRequirements sparse[MAX(count, 1)];
+   vc->vk.GetImageSparseMemoryRequirements(vc->device, slot->dst_image, &count, sparse);
+
+   /* Images smaller than a block only have a mip tail, which would have
+    * to be bound as a whole anyway.
+    */
+   if (count == 0 || !(sparse[0].formatProperties.aspectMask & VK_IMAGE_ASPECT_COLOR_BIT) ||
+       sparse[0].imageMipTailFirstLod == 0) {
+      g_warning("%ux%u is too small for sparse residency", slot->width, slot->height);
+      return false;
+   }
+
+   slot->granularity = sparse[0].formatProperties.imageGranularity;
+   slot->block_size = requirements.alignment;
+   slot->block_memory_type = find_image_memory(vc, requirements.memoryTypeBits, false /* host */, false /* protected */);
+
+   return vc->vk.CreateSemaphore(vc->device,
+                                 &(VkSemaphoreCreateInfo) {
+                                    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+                                 },
+                                 NULL,
+                                 &slot->bound) == VK_SUCCESS;
+}
+
+/* Binds memory to the blocks of pixbuf with content, and only those, then
+ * signals slot->bound. The blocks are the regions to upload and to read
+ * back. Returns the fraction of the image that is resident, or a negative
+ * value if the memory couldn't be allocated.
+ */
+float
+sparse_bind(struct data *vc, struct slot *slot, GdkPixbuf *pixbuf)
+{
+   const guint8 *pixels = gdk_pixbuf_read_pixels(pixbuf);
+   uint32_t row_stride = gdk_pixbuf_get_rowstride(pixbuf);
+   uint32_t block_width = slot->granularity.width;
+   uint32_t block_height = slot->granularity.height;
+   uint32_t n_total = ((slot->width + block_width - 1) / block_width) *
+                      ((slot->height + block_height - 1) / block_height);
+   VkSparseImageMemoryBind *binds = g_new(VkSparseImageMemoryBind, n_total);
+   bool *resident = g_new(bool, n_total);
+   uint32_t n = 0;
+
+   slot->blocks = g_renew(VkBufferImageCopy2, slot->blocks, n_total);
+   slot->n_blocks = 0;
+
+   for (uint32_t y = 0; y < slot->height; y += block_height) {
+      for (uint32_t x = 0; x < slot->width; x += block_width) {
+         uint32_t w = MIN(block_width, slot->width - x);
+         uint32_t h = MIN(block_height, slot->height - y);
+         resident[n] = false;
+         for (uint32_t row = y; !resident[n] && row < y + h; row++)
+            resident[n] = bytes_differ(pixels + (gsize) row * row_stride + x * 4, NULL, w * 4);
+
+         binds[n] = (VkSparseImageMemoryBind) {
+            .subresource = {
+               .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+               .mipLevel = 0,
+               .arrayLayer = 0,
+            },
+            .offset = { x, y, 0 },
+            .extent = { w, h, 1 },
+            /* Unbound unless resident, once the memory is known. */
+            .memory = VK_NULL_HANDLE,
+            .memoryOffset = resident[n] ? slot->n_blocks * slot->block_size : 0,
+         };
+
+         if (resident[n++]) {
+            slot->blocks[slot->n_blocks++] = (VkBufferImageCopy2) {
+               .sType = VK_STRUCTURE_TYPE_BUFFER_IMAGE_COPY_2,
+               .bufferOffset = (VkDeviceSize) y * slot->pitch + x * 4,
+               .bufferRowLength = slot->pitch / 4,
+               .bufferImageHeight = slot->height,
+               .imageSubresource = {
+                  .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                  .mipLevel = 0,
+                  .baseArrayLayer = 0,
+                  .layerCount = 1,
+               },
+               .imageOffset = { x, y, 0, },
+               .imageExtent = { w, h, 1 },
+            };
+         }
+      }
+   }
+
+   /* The memory being replaced may still be bound until the bind below
+    * has executed, it's freed once the slot comes around again.
+    */
+   vc->vk.FreeMemory(vc->device, slot->old_block_mem, NULL);
+   slot->old_block_mem = VK_NULL_HANDLE;
+
+   if (slot->n_blocks > slot->n_block_mem) {
+      slot->old_block_mem = slot->block_mem;
+      slot->block_mem = VK_NULL_HANDLE;
+      slot->n_block_mem = 0;
+
+      VkResult res = vc->vk.AllocateMemory(vc->device,
+                                           &(VkMemoryAllocateInfo) {
+                                              .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                                              .allocationSize = slot->n_blocks * slot->block_size,
+                                              .memoryTypeIndex = slot->block_memory_type,
+                                           },
+                                           NULL,
+                                           &slot->block_mem);
+      if (res != VK_SUCCESS) {
+         g_free(binds);
+         g_free(resident);
+         return -1.0f;
+      }
+      slot->n_block_mem = slot->n_blocks;
+   }
+
+   for (uint32_t i = 0; i < n; i++) {
+      if (resident[i])
+         binds[i].memory = slot->block_mem;
+   }
+
+   vc->vk.QueueBindSparse(slot->queue, 1,
+                          &(const VkBindSparseInfo) {
+                             .sType = VK_STRUCTURE_TYPE_BIND_SPARSE_INFO,
+                             .imageBindCount = 1,
+                             .pImageBinds = &(const VkSparseImageMemoryBindInfo) {
+                                .image = slot->dst_image,
+                                .bindCount = n,
+                                .pBinds = binds,
+                             },
+                             .signalSemaphoreCount = 1,
+                             .pSignalSemaphores = &slot->bound,
+                          },
+                          VK_NULL_HANDLE);
+
+   g_free(binds);
+   g_free(resident);
+
+   return (float) slot->n_blocks / n_total;
+}
+
+void
+sparse_release(struct data *vc, struct slot *slot)
+{
+   vc->vk.DestroySemaphore(vc->device, slot->bound, NULL);
+   vc->vk.FreeMemory(vc->device, slot->block_mem, NULL);
+   vc->vk.FreeMemory(vc->device, slot->old_block_mem, NULL);
+   g_clear_pointer(&slot->blocks, g_free);
+
+   slot->bound = VK_NULL_HANDLE;
+   slot->block_mem = slot->old_block_mem = VK_NULL_HANDLE;
+   slot->n_blocks = slot->n_block_mem = 0;
+}
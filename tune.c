@@ -0,0 +1,293 @@
+/*
+ * Copyright © 2021 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * --tune runs the upload → copy → readback of one image under every
+ * combination of the parameters below and keeps the fastest in the caps,
+ * for the size class of the image. The output encode doesn't depend on any
+ * of them and is left out of the measurement: the job has no output, and
+ * is read back without being written. Padded staging rows are only tried
+ * when the device's alignments actually pad the image's.
+ * Keeping the image in GENERAL, the transitions are skipped as of the
+ * second job of a slot.
+ */
+
+#include "blit.h"
+
+#define DEFAULT_DEPTH 2
+#define TUNE_ITERATIONS 16
+
+static const VkImageTiling tilings[] = {
+   VK_IMAGE_TILING_OPTIMAL,
+   VK_IMAGE_TILING_LINEAR,
+};
+
+static const struct {
+   uint32_t width, height;
+} tiles[] = {
+   { 0, 0 },
+   { 0, 64 },
+   { 0, 256 },
+   { 256, 256 },
+   { 512, 512 },
+};
+
+static const unsigned depths[] = { 1, 2, 3, 4 };
+
+static const bool layouts[] = { false, true };
+
+/* Images with the same number of pixels, up to the next power of two. */
+static char *
+size_class(uint32_t width, uint32_t height)
+{
+   return g_strdup_printf("tune-%u", g_bit_storage((gulong) width * height));
+}
+
+void
+tuning_lookup(struct data *vc, uint32_t width, uint32_t height, struct tuning *t)
+{
+   char *group = size_class(width, height);
+   int tiling, tile_width, tile_height, padded, general;
+
+   if (vc->tune) {
+      *t = *vc->tune;
+      g_free(group);
+      return;
+   }
+
+   *t = (struct tuning) {
+      .tiling = vc->tiling,
+      .depth = tuned_depth(vc),
+   };
+
+   if (caps_get(vc->caps, group, "tiling", &tiling) &&
+       caps_get(vc->caps, group, "tile-width", &tile_width) &&
+       caps_get(vc->caps, group, "tile-height", &tile_height)) {
+      t->tiling = tiling;
+      t->tile_width = tile_width;
+      t->tile_height = tile_height;
+   }
+   /* Missing from the caps of older versions. */
+   if (caps_get(vc->caps, group, "padded-rows", &padded))
+      t->padded = padded;
+   if (caps_get(vc->caps, group, "general-layout", &general))
+      t->general = general;
+
+   g_free(group);
+}
+
+/* The number of jobs in flight isn't per size class: the pipeline is
+ * created before the first image is decoded.
+ */
+unsigned
+tuned_depth(struct data *vc)
+{
+   int depth;
+
+   if (vc->tune)
+      return vc->tune->depth;
+   if (caps_get(vc->caps, "tune", "depth", &depth) && depth > 0)
+      return depth;
+
+   return DEFAULT_DEPTH;
+}
+
+static bool
+tiling_supported(struct data *vc, VkImageTiling tiling)
+{
+   VkFormatProperties properties;
+   VkFormatFeatureFlags transfer = VK_FORMAT_FEATURE_TRANSFER_SRC_BIT | VK_FORMAT_FEATURE_TRANSFER_DST_BIT;
+
+   vc->vk.GetPhysicalDeviceFormatProperties(vc->physical_device, VK_FORMAT_R8G8B8A8_UNORM, &properties);
+
+   if (tiling == VK_IMAGE_TILING_LINEAR)
+      return (properties.linearTilingFeatures & transfer) == transfer;
+   else
+      return (properties.optimalTilingFeatures & transfer) == transfer;
+}
+
+/* Waits for the previous use of the slot, if any, and submits the job again. */
+static bool
+cycle(struct data *vc, struct slot *slot, bool *busy, struct job *job)
+{
+   if (*busy) {
+      *busy = false;
+      if (slot_wait(vc, slot) != VK_SUCCESS)
+         return false;
+   }
+
+   if (!slot_prepare(vc, slot, job) || slot_submit(vc, slot) != VK_SUCCESS)
+      return false;
+
+   *busy = true;
+
+   return true;
+}
+
+static bool
+drain(struct data *vc, struct slot *slots, bool *busy, unsigned n)
+{
+   bool ok = true;
+
+   for (unsigned i = 0; i < n; i++) {
+      if (busy[i] && slot_wait(vc, &slots[i]) != VK_SUCCESS)
+         ok = false;
+      busy[i] = false;
+   }
+
+   return ok;
+}
+
+/* Average time of one image through a ring of t->depth slots, in
+ * microseconds, or -1 if the configuration doesn't work.
+ */
+static double
+measure(struct data *vc, struct job *job, const struct tuning *t)
+{
+   struct slot slots[t->depth];
+   bool busy[t->depth];
+   bool ok = true;
+   gint64 elapsed = 0;
+
+   vc->tune = t;
+
+   for (unsigned i = 0; i < t->depth; i++) {
+      slot_init(vc, &slots[i]);
+      busy[i] = false;
+   }
+
+   /* Creating the resources and recording the commands is done once per
+    * slot in the real pipeline, keep it out of the measurement. Twice for
+    * the general layout, whose second job records its commands again.
+    */
+   for (unsigned i = 0; ok && i < (t->general ? 2 : 1) * t->depth; i++)
+      ok = cycle(vc, &slots[i % t->depth], &busy[i % t->depth], job);
+   ok = drain(vc, slots, busy, t->depth) && ok;
+
+   if (ok) {
+      gint64 start = g_get_monotonic_time();
+
+      for (unsigned i = 0; ok && i < TUNE_ITERATIONS; i++)
+         ok = cycle(vc, &slots[i % t->depth], &busy[i % t->depth], job);
+      ok = drain(vc, slots, busy, t->depth) && ok;
+
+      elapsed = g_get_monotonic_time() - start;
+   }
+
+   for (unsigned i = 0; i < t->depth; i++)
+      slot_fini(vc, &slots[i]);
+
+   vc->tune = NULL;
+
+   return ok ? (double) elapsed / TUNE_ITERATIONS : -1;
+}
+
+int
+tune_run(struct data *vc, const char *input)
+{
+   struct job *job = job_new("tune", input, NULL);
+   struct tuning best = { 0, };
+   double best_time = -1;
+
+   job_decode(job);
+   if (job->error) {
+      g_warning("Unable to load image: %s", job->error->message);
+      job_free(job);
+      return 1;
+   }
+   /* The first frame stands for an animation. */
+   if (job->frames)
+      job->pixbuf = g_object_ref(g_ptr_array_index(job->frames, 0));
+
+   uint32_t width = gdk_pixbuf_get_width(job->pixbuf);
+   uint32_t height = gdk_pixbuf_get_height(job->pixbuf);
+   unsigned n_paddings = staging_pitch(vc, width, true) != width * 4 ? 2 : 1;
+
+   for (unsigned i = 0; i < G_N_ELEMENTS(tilings); i++) {
+      if (!tiling_supported(vc, tilings[i]))
+         continue;
+
+      for (unsigned j = 0; j < G_N_ELEMENTS(tiles); j++) {
+         for (unsigned k = 0; k < G_N_ELEMENTS(depths); k++) {
+            for (unsigned l = 0; l < n_paddings * G_N_ELEMENTS(layouts); l++) {
+               struct tuning t = {
+                  .tiling = tilings[i],
+                  .tile_width = tiles[j].width,
+                  .tile_height = tiles[j].height,
+                  .padded = l / G_N_ELEMENTS(layouts) > 0,
+                  .general = layouts[l % G_N_ELEMENTS(layouts)],
+                  .depth = depths[k],
+               };
+               double time = measure(vc, job, &t);
+
+               g_print("%-7s tiles %4ux%-4u %-6s rows %-8s layout depth %u: ",
+                       t.tiling == VK_IMAGE_TILING_LINEAR ? "linear" : "optimal",
+                       t.tile_width ? MIN(t.tile_width, width) : width,
+                       t.tile_height ? MIN(t.tile_height, height) : height,
+                       t.padded ? "padded" : "packed",
+                       t.general ? "general" : "transfer",
+                       t.depth);
+               if (time < 0) {
+                  g_print("failed\n");
+                  continue;
+               }
+               g_print("%.3f ms/image\n", time / 1000.0);
+
+               if (best_time < 0 || time < best_time) {
+                  best = t;
+                  best_time = time;
+               }
+            }
+         }
+      }
+   }
+
+   job_free(job);
+
+   if (best_time < 0) {
+      g_warning("No configuration could process %s", input);
+      return 1;
+   }
+
+   char *group = size_class(width, height);
+
+   caps_set(vc->caps, group, "tiling", best.tiling);
+   caps_set(vc->caps, group, "tile-width", best.tile_width);
+   caps_set(vc->caps, group, "tile-height", best.tile_height);
+   caps_set(vc->caps, group, "padded-rows", best.padded);
+   caps_set(vc->caps, group, "general-layout", best.general);
+   caps_set(vc->caps, "tune", "depth", best.depth);
+   caps_save(vc->caps);
+
+   g_print("Keeping %s tiling, %ux%u tiles, %s rows, %s layout and depth %u for %ux%u images (%s)\n",
+           best.tiling == VK_IMAGE_TILING_LINEAR ? "linear" : "optimal",
+           best.tile_width ? MIN(best.tile_width, width) : width,
+           best.tile_height ? MIN(best.tile_height, height) : height,
+           best.padded ? "padded" : "packed",
+           best.general ? "general" : "transfer",
+           best.depth, width, height, group);
+
+   g_free(group);
+
+   return 0;
+}
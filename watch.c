@@ -0,0 +1,112 @@
+/*
+ * Copyright © 2021 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "blit.h"
+
+static volatile sig_atomic_t watch_stop;
+
+static void
+watch_signal(int sig)
+{
+   watch_stop = 1;
+}
+
+static char *
+output_name(const char *output_dir, const char *name)
+{
+   const char *dot = strrchr(name, '.');
+   char *base = dot && dot != name ? g_strndup(name, dot - name) : g_strdup(name);
+   char *file = g_strconcat(base, ".png", NULL);
+   char *path = g_build_filename(output_dir, file, NULL);
+
+   g_free(file);
+   g_free(base);
+
+   return path;
+}
+
+/* Queues every file completed in input_dir (written and closed, or renamed
+ * into it) until SIGINT/SIGTERM. Files are only picked up once complete so
+ * writers don't need to coordinate with us.
+ */
+int
+watch_run(struct pipeline *p, const char *input_dir, const char *output_dir)
+{
+   int fd = inotify_init1(IN_CLOEXEC);
+   if (fd < 0) {
+      g_warning("inotify_init1: %s", g_strerror(errno));
+      return 1;
+   }
+
+   if (inotify_add_watch(fd, input_dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+      g_warning("Unable to watch %s: %s", input_dir, g_strerror(errno));
+      close(fd);
+      return 1;
+   }
+
+   /* No SA_RESTART so that read() returns with EINTR. */
+   struct sigaction sa = { .sa_handler = watch_signal };
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGTERM, &sa, NULL);
+
+   char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+   while (!watch_stop) {
+      ssize_t len = read(fd, buf, sizeof(buf));
+      if (len < 0) {
+         if (errno == EINTR)
+            continue;
+         g_warning("inotify read: %s", g_strerror(errno));
+         break;
+      }
+
+      for (char *ptr = buf; ptr < buf + len; ) {
+         const struct inotify_event *event = (const struct inotify_event *) ptr;
+         ptr += sizeof(struct inotify_event) + event->len;
+
+         if (event->mask & IN_Q_OVERFLOW)
+            g_warning("inotify queue overflow, some files in %s were missed", input_dir);
+
+         if (event->len == 0 || (event->mask & IN_ISDIR) || event->name[0] == '.')
+            continue;
+
+         char *input = g_build_filename(input_dir, event->name, NULL);
+         char *output = output_name(output_dir, event->name);
+
+         pipeline_queue(p, job_new(NULL, input, output));
+
+         g_free(input);
+         g_free(output);
+      }
+   }
+
+   close(fd);
+
+   return 0;
+}